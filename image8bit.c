@@ -22,21 +22,48 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "instrumentation.h"
+#include "image8bitPool.h"
+#include "image8bitSimd.h"
+#include "parallel.h"
 
 // The data structure
 //
-// An image is stored in a structure containing 3 fields:
+// An image is stored in a structure containing these fields:
 // Two integers store the image width and height.
-// The other field is a pointer to an array that stores the 8-bit gray
+// Another field is a pointer to an array that stores the 8-bit gray
 // level of each pixel in the image.  The pixel array is one-dimensional
 // and corresponds to a "raster scan" of the image from left to right,
 // top to bottom.
+// Rows start every `stride` pixels in the array, and pixel (0,0) is stored
+// at index `offset`.  For an image created by ImageCreate (or ImageLoad),
+// stride == width and offset == 0.
+// Indices into the pixel array (and pixel counts) are computed as size_t,
+// never as int, so an image may have many more than INT_MAX pixels: only
+// its width and height are limited to INT_MAX.
 // For example, in a 100-pixel wide image (img->width == 100),
 //   pixel position (x,y) = (33,0) is stored in img->pixel[33];
 //   pixel position (x,y) = (22,1) is stored in img->pixel[122].
+//
+// A view (see ImageCropView) is an image that shares the pixel array of
+// another image: it has its own width, height and offset, but the stride of
+// the image it views.  The pixel array is owned by a reference-counted
+// raster structure, so it is only freed when its last image is destroyed.
+// Pixel arrays are buffers of the pool (see image8bitPool.h), which are
+// recycled when freed.  But the pixel array of an image loaded by
+// ImageLoadMapped lies inside a private memory mapping of the PGM file;
+// the raster then records the mapping, so that it is unmapped instead.
 // 
 // Clients should use images only through variables of type Image,
 // which are pointers to the image structure, and should not access the
@@ -45,12 +72,23 @@
 // Maximum value you can store in a pixel (maximum maxval accepted)
 const uint8 PixMax = 255;
 
+// Internal structure for pixel arrays, shared by an image and its views
+struct raster {
+  atomic_int refs;  // number of images using this pixel array
+  uint8* data;      // the pixel array
+  void* map;        // start of the file mapping holding data (or NULL)
+  size_t size;      // length of the mapping, or size of data (if no mapping)
+};
+
 // Internal structure for storing 8-bit graymap images
 struct image {
   int width;
   int height;
   int maxval;   // maximum gray value (pixels with maxval are pure WHITE)
+  size_t stride;  // distance between the starts of consecutive rows
+  size_t offset;  // index of pixel (0,0) in the pixel array
   uint8* pixel; // pixel data (a raster scan)
+  struct raster* raster;  // owner of the pixel data (raster->data == pixel)
 };
 
 
@@ -70,14 +108,16 @@ struct image {
 // the ImageErrMsg() function to produce informative error messages.
 // The use of the GNU standard library error() function is recommended for
 // this purpose.
+// Like errno, errCause (and errsave) are thread-local, so functions may fail
+// concurrently, in several threads, each getting its own error cause.
 //
 // Additional information:  man 3 errno;  man 3 error;
 
 // Variable to preserve errno temporarily
-static int errsave = 0;
+static _Thread_local int errsave = 0;
 
-// Error cause
-static char* errCause;
+// Error cause (of the last failure in the running thread)
+static _Thread_local char* errCause = "";
 
 /// Error cause.
 /// After some other module function fails (and returns an error code),
@@ -87,6 +127,8 @@ static char* errCause;
 ///
 /// After a successful operation, the result is not garanteed (it might be
 /// the previous error cause).  It is not meant to be used in that situation!
+/// Like errno, the error cause is kept per thread: this function must be
+/// called in the thread where the failure happened.
 char* ImageErrMsg() { ///
   return errCause;
 }
@@ -141,27 +183,262 @@ static int check(int condition, const char* failmsg) {
 }
 
 
+// Row kernels used by some operations (see image8bitSimd.h).
+// ImageInit selects the best ones for the running CPU.
+static const PixKernels* kernels = &PixKernelsScalar;
+
+// Maximum number of bytes retained by the pool of buffers (see Buffers),
+// unless set by the IMAGE8BIT_POOL environment variable.
+#define POOL_LIMIT ((size_t)256 << 20)
+
+// Gauge of the bytes retained by the pool of buffers
+static unsigned long poolBytes(void) {
+  return (unsigned long)PoolRetained();
+}
+
 /// Init Image library.  (Call once!)
-/// Currently, simply calibrate instrumentation and set names of counters.
+/// Set names of counters and gauges, select the row kernels for the
+/// running CPU, and configure the pool of buffers.
+/// (Instrumentation is calibrated later, only if times are printed.)
+/// The IMAGE8BIT_SIMD environment variable may name the instruction set to
+/// use ("scalar", "sse2" or "avx2"), if it is supported.
+/// The IMAGE8BIT_POOL environment variable may set the maximum number of
+/// MiB retained in the pool of freed buffers (default 256, 0 disables the
+/// reuse of buffers), and IMAGE8BIT_HUGEPAGES=1 asks for huge pages.
+/// INSTR_PERF=1 adds hardware counters to the times printed (see
+/// InstrPerfInit): they are opened here, before any worker thread exists.
 void ImageInit(void) { ///
-  InstrCalibrate();
+  InstrPerfInit();
+  const PixKernels* k = PixKernelsSelect(getenv("IMAGE8BIT_SIMD"));
+  kernels = k != NULL ? k : PixKernelsSelect(NULL);
   InstrName[0] = "pixmem";  // InstrCount[0] will count pixel array acesses
   InstrName[1] = "pixmemwr";  // InstrName[1] will count pixel array writes
   InstrName[2] = "pixmemre";  // InstrName[2] will count pixel array reads
   InstrName[3] = "pixcomp";  // InstrName[3] will count pixel comparisons
+  InstrName[4] = "poolhit";  // InstrName[4] will count buffers reused from the pool
+  InstrName[5] = "poolmiss";  // InstrName[5] will count buffers allocated anew
+  InstrGaugeName[0] = "poolbytes";  // bytes retained in the pool
+  InstrGauge[0] = poolBytes;
+
+  const char* limit = getenv("IMAGE8BIT_POOL");
+  const char* huge = getenv("IMAGE8BIT_HUGEPAGES");
+  PoolConfigure(limit != NULL ? (size_t)strtoull(limit, NULL, 10) << 20 : POOL_LIMIT,
+                huge != NULL && strcmp(huge, "0") != 0);
+}
+
+// Counters of the running thread: its own block of instrumentation
+// counters (see InstrThreadCounters), so threads processing bands in
+// parallel never write to the same counters (nor cache lines).
+static _Thread_local unsigned long* counts = NULL;
+
+static inline unsigned long* threadCounts(void) {
+  if (counts == NULL) {
+    counts = InstrThreadCounters();
+  }
+  return counts;
 }
 
 // Macros to simplify accessing instrumentation counters:
-#define PIXMEM InstrCount[0]
-#define PIXMEMWR InstrCount[1]
-#define PIXMEMRE InstrCount[2]
-#define PIXCOMP InstrCount[3]
+#define PIXMEM threadCounts()[0]
+#define PIXMEMWR threadCounts()[1]
+#define PIXMEMRE threadCounts()[2]
+#define PIXCOMP threadCounts()[3]
+#define POOLHIT threadCounts()[4]
+#define POOLMISS threadCounts()[5]
 
 // TIP: Search for PIXMEM or InstrCount to see where it is incremented!
 
+// Add n to counter c.
+// Compiling with -DIMAGE8BIT_NOCOUNT (as in make release) removes all the
+// counting, so instrumentation costs nothing in production builds.
+#ifndef IMAGE8BIT_NOCOUNT
+#define COUNT(c, n) ((c) += (unsigned long)(n))
+#else
+#define COUNT(c, n) ((void)(n))
+#endif
+
+// Macros to count pixel accesses in bulk (for instance, once per row):
+#define COUNT_READS(n) (COUNT(PIXMEM, n), COUNT(PIXMEMRE, n))
+#define COUNT_WRITES(n) (COUNT(PIXMEM, n), COUNT(PIXMEMWR, n))
+
+// Raster access
+//
+// ImageGetPixel / ImageSetPixel are the reference way to access pixels, but
+// they check their preconditions and update the counters on every call.
+// Kernels that sweep whole rows use the internal functions below instead:
+// they get a pointer to the first pixel of a row and walk it linearly, which
+// lets the compiler vectorize the inner loops.  Such kernels must count the
+// pixel accesses themselves, in bulk, with COUNT_READS / COUNT_WRITES.
+
+// Pointer to pixel (0, y), the first pixel of row y.
+static inline uint8* Row(Image img, int y) {
+  assert (0 <= y && y < img->height);
+  return img->pixel + img->offset + (size_t)y * img->stride;
+}
+
+// Pointer to pixel (x, y).  Pixels (x, y), (x+1, y), ... are contiguous.
+static inline uint8* RowAt(Image img, int x, int y) {
+  assert (ImageValidPos(img, x, y));
+  return Row(img, y) + x;
+}
+
+
+// Parallel execution
+//
+// Some operations split the image in horizontal bands of rows, which are
+// processed concurrently by the thread pool (see parallel.h).  Each band
+// writes only to its own rows, so the result does not depend on the number
+// of threads nor on their timing: it is identical to the serial result.
+//
+// Each thread counts pixel accesses in its own block of counters, and
+// InstrPrint adds them all up, so the totals are still correct.
+
+/// Set the number of threads used by image operations.
+void ImageSetThreads(int n) { ///
+  ParallelSetThreads(n);
+}
+
+// A function that processes band b, made of rows [y0, y1).
+typedef void (*BandFn)(void* arg, int b, int y0, int y1);
+
+// A set of bands to process in parallel.
+typedef struct {
+  BandFn fn;
+  void* arg;
+  int h;          // total number of rows
+  int nbands;     // number of bands
+} Bands;
+
+// First row of band b, when splitting h rows into nbands bands.
+static int bandStart(int h, int nbands, int b) {
+  return (int)((long long)h * b / nbands);
+}
+
+static void runBand(void* arg, int b) {
+  const Bands* bands = (const Bands*)arg;
+  InstrTraceBegin("band", NULL);
+  bands->fn(bands->arg, b, bandStart(bands->h, bands->nbands, b),
+            bandStart(bands->h, bands->nbands, b + 1));
+  InstrTraceEnd();
+}
+
+// Number of bands to use for h rows: one per thread, but at most h.
+static int numBands(int h) {
+  const int n = ParallelThreads();
+  return n < h ? n : (h > 0 ? h : 1);
+}
+
+// Split rows [0, h) into nbands bands and call fn(arg, b, y0, y1) for each
+// band b = [y0, y1), in parallel.  Each band is a span of the trace, in
+// the thread that runs it.
+static void ForBands(int h, int nbands, BandFn fn, void* arg) {
+  if (nbands <= 1) {
+    InstrTraceBegin("band", NULL);
+    fn(arg, 0, 0, h);
+    InstrTraceEnd();
+    return;
+  }
+  Bands bands = { .fn = fn, .arg = arg, .h = h, .nbands = nbands };
+  ParallelFor(nbands, runBand, &bands);
+}
+
 
 /// Image management functions
 
+// Buffers
+//
+// Pixel arrays and large temporary buffers come from the pool of
+// image8bitPool, through these functions, which count pool hits (buffers
+// reused) and misses (buffers requested from the system), and trace
+// allocations as spans.
+
+// Get a buffer of size bytes (zeroed, if zero is set), or NULL.
+static void* bufferAlloc(size_t size, int zero) {
+  int hit;
+  InstrTraceBegin("alloc", NULL);
+  void* p = PoolAlloc(size, zero, &hit);
+  InstrTraceEnd();
+  if (p != NULL) {
+    if (hit) {
+      COUNT(POOLHIT, 1);
+    } else {
+      COUNT(POOLMISS, 1);
+    }
+  }
+  return p;
+}
+
+// Return a buffer of size bytes from bufferAlloc.
+static void bufferFree(void* p, size_t size) {
+  PoolFree(p, size);
+}
+
+// Create an image structure and a raster owning the given pixel array.
+// If map is NULL, data must be a buffer of size bytes from bufferAlloc.
+// Otherwise, data lies inside a file mapping of size bytes, starting at map.
+// On failure, returns NULL (data is not released) and errno/errCause are set.
+static Image imageWrap(int width, int height, uint8 maxval, uint8* data,
+                       void* map, size_t size) {
+  const Image image = (Image)malloc(sizeof(struct image));
+  if (!check(image != NULL, "Cannot allocate memory for image")) {
+    return NULL;
+  }
+
+  struct raster* raster = (struct raster*)malloc(sizeof(struct raster));
+  if (!check(raster != NULL, "Cannot allocate memory for raster")) {
+    free(image);
+    return NULL;
+  }
+  atomic_init(&raster->refs, 1);
+  raster->data = data;
+  raster->map = map;
+  raster->size = size;
+
+  *image = (struct image){
+      .width = width,
+      .height = height,
+      .maxval = maxval,
+      .stride = (size_t)width,
+      .offset = 0,
+      .pixel = raster->data,
+      .raster = raster,
+  };
+  return image;
+}
+
+// Create a new image, with a new pixel array (zeroed, if zero is set).
+// On failure, returns NULL and errno/errCause are set accordingly.
+static Image imageNew(int width, int height, uint8 maxval, int zero) {
+  // The number of pixels must fit in size_t (it always does with 64 bits).
+  if (height > 0 && (size_t)width > SIZE_MAX / (size_t)height) {
+    errno = ENOMEM;
+    check(0, "Image too large");
+    return NULL;
+  }
+  const size_t size = (size_t)width * (size_t)height;
+  uint8* data = (uint8*)bufferAlloc(size, zero);
+  if (!check(data != NULL, "Cannot allocate memory for pixel data")) {
+    return NULL;
+  }
+  const Image image = imageWrap(width, height, maxval, data, NULL, size);
+  if (image == NULL) {
+    errsave = errno;
+    bufferFree(data, size);
+    errno = errsave;
+  }
+  return image;
+}
+
+// Release a raster, when its last image is destroyed.
+static void rasterRelease(struct raster* raster) {
+  if (raster->map != NULL) {
+    munmap(raster->map, raster->size);
+  } else {
+    bufferFree(raster->data, raster->size);
+  }
+  free(raster);
+}
+
 /// Create a new black image.
 ///   width, height : the dimensions of the new image.
 ///   maxval: the maximum gray level (corresponding to white).
@@ -175,25 +452,14 @@ Image ImageCreate(int width, int height, uint8 maxval) { ///
   assert (height >= 0);
   assert (0 < maxval && maxval <= PixMax);
 
-  const Image image = (Image)malloc(sizeof(struct image));
-  if (check(image == NULL, "Cannot allocate memory for image")) {
-    return NULL;
-  }
-
-  *image = (struct image){
-      .width = width,
-      .height = height,
-      .maxval = maxval,
-      .pixel = (uint8*)calloc(width * height, sizeof(uint8)),
-  };
-
-  if (check(image->pixel == NULL, "Cannot allocate memory for pixel data")) {
-    free(image);
+  const Image image = imageNew(width, height, maxval, 1);
+  if (image == NULL) {
     return NULL;
   }
-  // calloc initializes allocated array to 0, so count all the writes
-  PIXMEM += (unsigned long) (width * height);
-  PIXMEMWR += (unsigned long) (width * height);
+  // The pool zeroes the buffer (with memset, unless it is a fresh mapping,
+  // which the system zeroes), so count all the writes
+  COUNT(PIXMEM, (size_t)width * height);
+  COUNT(PIXMEMWR, (size_t)width * height);
 
   return image;
 }
@@ -208,8 +474,11 @@ void ImageDestroy(Image* imgp) { ///
 
   const Image image = *imgp;
   if (image != NULL) {
-    // Pixel data pointer will never be NULL on a valid image
-    free(image->pixel);
+    // Pixel data pointer will never be NULL on a valid image.
+    // It is freed with the last image (or view) that uses it.
+    if (atomic_fetch_sub(&image->raster->refs, 1) == 1) {
+      rasterRelease(image->raster);
+    }
     free(image);
     *imgp = NULL;
   }
@@ -234,6 +503,21 @@ static int skipComments(FILE* f) {
   return i;
 }
 
+// Parse the PGM header of file f, leaving f at the first pixel.
+// On failure, returns 0 and errCause is set.
+static int readHeader(FILE* f, int* w, int* h, int* maxval) {
+  char c, s;
+  return
+  check( fscanf(f, "P%c%c ", &c, &s) == 2 && c == '5' && isspace(s) , "Invalid file format" ) &&
+  skipComments(f) >= 0 &&
+  check( fscanf(f, "%d ", w) == 1 && *w >= 0 , "Invalid width" ) &&
+  skipComments(f) >= 0 &&
+  check( fscanf(f, "%d ", h) == 1 && *h >= 0 , "Invalid height" ) &&
+  skipComments(f) >= 0 &&
+  check( fscanf(f, "%d", maxval) == 1 && 0 < *maxval && *maxval <= (int)PixMax , "Invalid maxval" ) &&
+  check( fscanf(f, "%c", &c) == 1 && isspace(c) , "Whitespace expected" );
+}
+
 /// Load a raw PGM file.
 /// Only 8 bit PGM files are accepted.
 /// On success, a new image is returned.
@@ -242,26 +526,18 @@ static int skipComments(FILE* f) {
 Image ImageLoad(const char* filename) { ///
   int w, h;
   int maxval;
-  char c;
   FILE* f = NULL;
   Image img = NULL;
 
   int success = 
   check( (f = fopen(filename, "rb")) != NULL, "Open failed" ) &&
-  // Parse PGM header
-  check( fscanf(f, "P%c ", &c) == 1 && c == '5' , "Invalid file format" ) &&
-  skipComments(f) >= 0 &&
-  check( fscanf(f, "%d ", &w) == 1 && w >= 0 , "Invalid width" ) &&
-  skipComments(f) >= 0 &&
-  check( fscanf(f, "%d ", &h) == 1 && h >= 0 , "Invalid height" ) &&
-  skipComments(f) >= 0 &&
-  check( fscanf(f, "%d", &maxval) == 1 && 0 < maxval && maxval <= (int)PixMax , "Invalid maxval" ) &&
-  check( fscanf(f, "%c", &c) == 1 && isspace(c) , "Whitespace expected" ) &&
-  // Allocate image
-  (img = ImageCreate(w, h, (uint8)maxval)) != NULL &&
+  readHeader(f, &w, &h, &maxval) &&
+  // Allocate image (no need to zero the pixels: they are read next)
+  (img = imageNew(w, h, (uint8)maxval, 0)) != NULL &&
   // Read pixels
-  check( fread(img->pixel, sizeof(uint8), w*h, f) == w*h , "Reading pixels" );
-  PIXMEM += (unsigned long)(w*h);  // count pixel memory accesses
+  check( fread(img->pixel, sizeof(uint8), (size_t)w*h, f) == (size_t)w*h , "Reading pixels" );
+  COUNT_WRITES((size_t)w*h);  // count pixel memory accesses
+  COUNT(PIXMEM, (size_t)w*h);
 
   // Cleanup
   if (!success) {
@@ -273,6 +549,91 @@ Image ImageLoad(const char* filename) { ///
   return img;
 }
 
+// Skip whitespace and comment lines in p[*i..n-1].
+static void skipSpace(const uint8* p, size_t n, size_t* i) {
+  while (*i < n && (isspace(p[*i]) || p[*i] == '#')) {
+    if (p[*i] == '#') {
+      while (*i < n && p[*i] != '\n') ++*i;
+    } else {
+      ++*i;
+    }
+  }
+}
+
+// Parse a non-negative decimal integer from p[*i..n-1] into *v.
+// Returns 0 if there are no digits or the value is too large.
+static int parseInt(const uint8* p, size_t n, size_t* i, int* v) {
+  const size_t start = *i;
+  long long value = 0;
+  while (*i < n && isdigit(p[*i]) && value <= INT_MAX) {
+    value = value * 10 + (p[*i] - '0');
+    ++*i;
+  }
+  *v = (int)value;
+  return *i > start && value <= INT_MAX;
+}
+
+// Parse the PGM header in p[0..n-1].
+// On success, returns nonzero and sets the image parameters and the length
+// of the header (the offset of the pixels).
+// On failure, returns 0 and errCause is set.
+static int parseHeader(const uint8* p, size_t n, int* w, int* h, int* maxval,
+                       size_t* len) {
+  size_t i = 2;
+  int success =
+  check( n > 2 && p[0] == 'P' && p[1] == '5' && isspace(p[2]) , "Invalid file format" ) &&
+  (skipSpace(p, n, &i), 1) &&
+  check( parseInt(p, n, &i, w) , "Invalid width" ) &&
+  (skipSpace(p, n, &i), 1) &&
+  check( parseInt(p, n, &i, h) , "Invalid height" ) &&
+  (skipSpace(p, n, &i), 1) &&
+  check( parseInt(p, n, &i, maxval) && 0 < *maxval && *maxval <= (int)PixMax , "Invalid maxval" ) &&
+  check( i < n && isspace(p[i]) , "Whitespace expected" );
+  *len = i + 1;
+  return success;
+}
+
+/// Load a raw PGM file, mapping it into memory.
+/// The pixels of the image are not read nor copied: they are accessed
+/// directly in a private memory mapping of the file, so loading takes
+/// (almost) constant time, and pixels are read from the file as needed.
+/// Changes to the image are private: they are not written to the file.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageLoadMapped(const char* filename) { ///
+  int w, h;
+  int maxval;
+  size_t len;
+  struct stat st;
+  int fd = -1;
+  void* map = MAP_FAILED;
+  Image img = NULL;
+
+  int success =
+  check( (fd = open(filename, O_RDONLY)) >= 0, "Open failed" ) &&
+  check( fstat(fd, &st) == 0, "Open failed" ) &&
+  check( st.st_size > 0 , "Invalid file format" ) &&
+  check( (map = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                     fd, 0)) != MAP_FAILED, "Mapping file failed" ) &&
+  parseHeader((const uint8*)map, (size_t)st.st_size, &w, &h, &maxval, &len) &&
+  check( (size_t)st.st_size - len >= (size_t)w * h , "Reading pixels" ) &&
+  (img = imageWrap(w, h, (uint8)maxval, (uint8*)map + len, map, (size_t)st.st_size)) != NULL;
+
+  // Cleanup (the mapping remains valid after closing the file)
+  if (!success) {
+    errsave = errno;
+    if (map != MAP_FAILED) munmap(map, (size_t)st.st_size);
+    errno = errsave;
+  }
+  if (fd >= 0) {
+    errsave = errno;
+    close(fd);
+    errno = errsave;
+  }
+  return img;
+}
+
 /// Save image to PGM file.
 /// On success, returns nonzero.
 /// On failure, returns 0, errno/errCause are set appropriately, and
@@ -286,9 +647,12 @@ int ImageSave(Image img, const char* filename) { ///
 
   int success =
   check( (f = fopen(filename, "wb")) != NULL, "Open failed" ) &&
-  check( fprintf(f, "P5\n%d %d\n%u\n", w, h, maxval) > 0, "Writing header failed" ) &&
-  check( fwrite(img->pixel, sizeof(uint8), w*h, f) == w*h, "Writing pixels failed" ); 
-  PIXMEM += (unsigned long)(w*h);  // count pixel memory accesses
+  check( fprintf(f, "P5\n%d %d\n%u\n", w, h, maxval) > 0, "Writing header failed" );
+  // Write pixels, row by row (in a view, rows are not contiguous)
+  for (int y = 0; success && y < h; y++) {
+    success = check( fwrite(Row(img, y), sizeof(uint8), w, f) == w, "Writing pixels failed" );
+  }
+  COUNT(PIXMEM, (size_t)w*h);  // count pixel memory accesses
 
   // Cleanup
   if (f != NULL) fclose(f);
@@ -296,6 +660,165 @@ int ImageSave(Image img, const char* filename) { ///
 }
 
 
+/// Streaming PGM file operations
+
+// A PGM file open for reading or writing by bands of rows.
+// Pixel offsets in the file are computed as off_t, so files may be much
+// larger than any image that fits in memory.
+struct imageStream {
+  FILE* f;
+  int width;
+  int height;
+  int maxval;
+  off_t start;  // file offset of the first pixel
+  int next;     // next row to read or write
+  int writing;  // nonzero if open for writing
+};
+
+/// Open a raw PGM file for reading by bands of rows.
+/// On success, returns a new stream.
+/// (The caller is responsible for closing it!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageStream ImageStreamOpen(const char* filename) { ///
+  ImageStream s = (ImageStream)calloc(1, sizeof(struct imageStream));
+  if (!check(s != NULL, "Cannot allocate memory for stream")) {
+    return NULL;
+  }
+
+  int success =
+  check( (s->f = fopen(filename, "rb")) != NULL, "Open failed" ) &&
+  readHeader(s->f, &s->width, &s->height, &s->maxval) &&
+  check( (s->start = ftello(s->f)) >= 0, "Open failed" );
+
+  if (!success) {
+    errsave = errno;
+    if (s->f != NULL) fclose(s->f);
+    free(s);
+    errno = errsave;
+    return NULL;
+  }
+  return s;
+}
+
+/// Create a raw PGM file for writing by bands of rows.
+/// On success, returns a new stream.
+/// (The caller is responsible for closing it!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageStream ImageStreamCreate(const char* filename, int width, int height, uint8 maxval) { ///
+  assert (width >= 0);
+  assert (height >= 0);
+  assert (0 < maxval && maxval <= PixMax);
+
+  ImageStream s = (ImageStream)calloc(1, sizeof(struct imageStream));
+  if (!check(s != NULL, "Cannot allocate memory for stream")) {
+    return NULL;
+  }
+  *s = (struct imageStream){ .width = width, .height = height, .maxval = maxval,
+                             .writing = 1 };
+
+  int success =
+  check( (s->f = fopen(filename, "wb")) != NULL, "Open failed" ) &&
+  check( fprintf(s->f, "P5\n%d %d\n%u\n", width, height, maxval) > 0, "Writing header failed" );
+
+  if (!success) {
+    errsave = errno;
+    if (s->f != NULL) fclose(s->f);
+    free(s);
+    errno = errsave;
+    return NULL;
+  }
+  return s;
+}
+
+/// Close a stream, and set (*sp) to NULL.
+/// If a stream open for writing was not written completely, the file is
+/// left invalid.
+/// On success, returns nonzero, and errno/errCause are preserved (so this
+/// may be used to clean up after other failures).
+/// On failure (when writing), returns 0 and errno/errCause are set.
+int ImageStreamClose(ImageStream* sp) { ///
+  assert (sp != NULL);
+  assert (*sp != NULL);
+
+  ImageStream s = *sp;
+  int success = 1;
+  if (fclose(s->f) != 0 && s->writing) {
+    success = check( 0, "Writing pixels failed" );
+  }
+  free(s);
+  *sp = NULL;
+  return success;
+}
+
+/// Get the width of the image in a stream
+int ImageStreamWidth(ImageStream s) { ///
+  assert (s != NULL);
+  return s->width;
+}
+
+/// Get the height of the image in a stream
+int ImageStreamHeight(ImageStream s) { ///
+  assert (s != NULL);
+  return s->height;
+}
+
+/// Get the maximum gray level of the image in a stream
+int ImageStreamMaxval(ImageStream s) { ///
+  assert (s != NULL);
+  return s->maxval;
+}
+
+/// Read rows [y, y+h) of the image in stream s into img, where h is the
+/// height of img.
+/// Requires: s must be open for reading.
+///           img must have the width of the image in s.
+///           The rows must be inside the image in s.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set.
+int ImageStreamRead(ImageStream s, int y, Image img) { ///
+  assert (s != NULL && !s->writing);
+  assert (img != NULL);
+  assert (img->width == s->width);
+  assert (0 <= y && y <= s->height - img->height);
+
+  const int w = img->width;
+  int success = 1;
+  if (y != s->next) {
+    success = check( fseeko(s->f, s->start + (off_t)y * w, SEEK_SET) == 0, "Reading pixels" );
+  }
+  for (int j = 0; success && j < img->height; j++) {
+    success = check( fread(Row(img, j), sizeof(uint8), w, s->f) == w, "Reading pixels" );
+    COUNT_WRITES(w);
+  }
+  s->next = success ? y + img->height : -1;
+  return success;
+}
+
+/// Write rows [y0, y1) of img to stream s, as the next rows of its image.
+/// Requires: s must be open for writing.
+///           img must have the width of the image in s.
+///           0 <= y0 <= y1 <= height of img, and the rows must fit in the
+///           rest of the image in s.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set.
+int ImageStreamWrite(ImageStream s, Image img, int y0, int y1) { ///
+  assert (s != NULL && s->writing);
+  assert (img != NULL);
+  assert (img->width == s->width);
+  assert (0 <= y0 && y0 <= y1 && y1 <= img->height);
+  assert (y1 - y0 <= s->height - s->next);
+
+  const int w = img->width;
+  int success = 1;
+  for (int j = y0; success && j < y1; j++) {
+    success = check( fwrite(Row(img, j), sizeof(uint8), w, s->f) == w, "Writing pixels failed" );
+    COUNT_READS(w);
+  }
+  s->next += y1 - y0;
+  return success;
+}
+
+
 /// Information queries
 
 /// These functions do not modify the image and never fail.
@@ -333,15 +856,8 @@ void ImageStats(Image img, uint8* min, uint8* max) { ///
   assert (min != NULL && max != NULL);
 
   for (int y = 0; y < img->height; ++y) {
-    for (int x = 0; x < img->width; ++x) {
-      const uint8 pixelValue = ImageGetPixel(img, x, y);
-      if (pixelValue < *min) {
-        *min = pixelValue;
-      }
-      if (pixelValue > *max) {
-        *max = pixelValue;
-      }
-    }
+    kernels->minmax(Row(img, y), (size_t)img->width, min, max);
+    COUNT_READS(img->width);
   }
 }
 
@@ -361,8 +877,8 @@ int ImageValidRect(Image img, int x, int y, int w, int h) {
   assert (w >= 0);
   assert (h >= 0);
 
-  return ImageValidPos(img, x, y) && x + w <= img->width
-         && y + h <= img->height;
+  return ImageValidPos(img, x, y) && w <= img->width - x
+         && h <= img->height - y;
 }
 
 /// Pixel get & set operations
@@ -374,11 +890,12 @@ int ImageValidRect(Image img, int x, int y, int w, int h) {
 
 // Transform (x, y) coords into linear pixel index.
 // This internal function is used in ImageGetPixel / ImageSetPixel. 
-// The returned index must satisfy (0 <= index < img->width*img->height)
-static inline int G(Image img, int x, int y) {
-  int index = y * img->width + x;
+// The returned index must satisfy
+//   (offset <= index < offset + (height-1)*stride + width)
+static inline size_t G(Image img, int x, int y) {
+  size_t index = img->offset + (size_t)y * img->stride + (size_t)x;
 
-  assert (0 <= index && index < img->width*img->height);
+  assert (img->offset <= index && index < img->offset + (size_t)(img->height-1)*img->stride + (size_t)img->width);
   return index;
 }
 
@@ -386,8 +903,8 @@ static inline int G(Image img, int x, int y) {
 uint8 ImageGetPixel(Image img, int x, int y) { ///
   assert (img != NULL);
   assert (ImageValidPos(img, x, y));
-  PIXMEM += 1;  // count one pixel access (read)
-  PIXMEMRE += 1;  // count one pixel read
+  COUNT(PIXMEM, 1);  // count one pixel access (read)
+  COUNT(PIXMEMRE, 1);  // count one pixel read
   return img->pixel[G(img, x, y)];
 } 
 
@@ -395,8 +912,8 @@ uint8 ImageGetPixel(Image img, int x, int y) { ///
 void ImageSetPixel(Image img, int x, int y, uint8 level) { ///
   assert (img != NULL);
   assert (ImageValidPos(img, x, y));
-  PIXMEM += 1;  // count one pixel access (store)
-  PIXMEMWR += 1;  // count one pixel store
+  COUNT(PIXMEM, 1);  // count one pixel access (store)
+  COUNT(PIXMEMWR, 1);  // count one pixel store
   img->pixel[G(img, x, y)] = level;
 } 
 
@@ -409,6 +926,49 @@ void ImageSetPixel(Image img, int x, int y, uint8 level) { ///
 /// They never fail.
 
 
+// Point operations
+//
+// All the functions below transform each pixel level independently of its
+// position and of the other pixels.  Such a transformation is fully described
+// by a table with the new level for each of the 256 possible levels, so each
+// of them builds that lookup table (LUT) once and then streams the image
+// through ImageApplyLUT, which costs one table lookup per pixel.
+// ImageNegative and ImageThreshold are even simpler, and use the (vectorized)
+// row kernels directly.
+
+/// Apply a lookup table to image.
+///   img : the image to modify.
+///   lut : the table of new levels, indexed by old level.
+/// Requires: img and lut must not be NULL,
+///           lut entries must not exceed img maxval.
+/// 
+/// Each pixel with level v is set to lut[v].
+typedef struct {
+  Image img;
+  const uint8* lut;
+} LUTJob;
+
+static void lutBand(void* arg, int b, int y0, int y1) {
+  const LUTJob* job = (const LUTJob*)arg;
+  const uint8* lut = job->lut;
+  for (int y = y0; y < y1; ++y) {
+    uint8* row = Row(job->img, y);
+    for (int x = 0; x < job->img->width; ++x) {
+      row[x] = lut[row[x]];
+    }
+    COUNT_READS(job->img->width);
+    COUNT_WRITES(job->img->width);
+  }
+}
+
+void ImageApplyLUT(Image img, const uint8 lut[256]) { ///
+  assert (img != NULL);
+  assert (lut != NULL);
+
+  LUTJob job = { .img = img, .lut = lut };
+  ForBands(img->height, numBands(img->height), lutBand, &job);
+}
+
 /// Transform image to negative image.
 ///   img : the image to modify.
 /// Requires: img must not be NULL.
@@ -419,9 +979,9 @@ void ImageNegative(Image img) { ///
   assert (img != NULL);
 
   for (int y = 0; y < img->height; ++y) {
-    for (int x = 0; x < img->width; ++x) {
-      ImageSetPixel(img, x, y, img->maxval - ImageGetPixel(img, x, y));
-    }
+    kernels->negative(Row(img, y), (size_t)img->width, (uint8)img->maxval);
+    COUNT_READS(img->width);
+    COUNT_WRITES(img->width);
   }
 }
 
@@ -436,10 +996,9 @@ void ImageThreshold(Image img, uint8 thr) { ///
   assert (img != NULL);
 
   for (int y = 0; y < img->height; ++y) {
-    for (int x = 0; x < img->width; ++x) {
-      const uint8 pixel = ImageGetPixel(img, x, y);
-      ImageSetPixel(img, x, y, pixel < thr ? 0 : img->maxval);
-    }
+    kernels->threshold(Row(img, y), (size_t)img->width, thr, (uint8)img->maxval);
+    COUNT_READS(img->width);
+    COUNT_WRITES(img->width);
   }
 }
 
@@ -451,6 +1010,14 @@ static int minInt(int x, int y) {
   return y;
 }
 
+/// Return the maximum integer between x and y.
+static int maxInt(int x, int y) {
+  if (x > y) {
+    return x;
+  }
+  return y;
+}
+
 /// Clamp x between min and max.
 /// If x < min, returns min.
 /// If x > max, returns max.
@@ -490,86 +1057,337 @@ void ImageBrighten(Image img, double factor) { ///
   assert (img != NULL);
   // ? assert (factor >= 0.0);
 
-  for (int y = 0; y < img->height; ++y) {
-    for (int x = 0; x < img->width; ++x) {
-      const double brightenedValue = factor * (double)ImageGetPixel(img, x, y);
+  uint8 lut[256];
+  for (int v = 0; v < 256; ++v) {
+    const double brightenedValue = factor * (double)v;
 
-      // Since `round` from `math.h` is inaccessible, we resort to adding 0.5.
-      // This does not work for negative numbers, but `clampDouble` makes sure
-      // we never have a negative number.
-      const uint8 level = (uint8)clampDouble(brightenedValue + 0.5, 0.0, (double)img->maxval);
-      ImageSetPixel(img, x, y, level);
-    }
+    // We round by adding 0.5 (instead of using `round`) to keep the original
+    // results.  This does not work for negative numbers, but `clampDouble`
+    // makes sure we never have a negative number.
+    lut[v] = (uint8)clampDouble(brightenedValue + 0.5, 0.0, (double)img->maxval);
   }
+  ImageApplyLUT(img, lut);
 }
 
-/// Geometric transformations
-
-/// These functions apply geometric transformations to an image,
-/// returning a new image as a result.
-/// 
-/// Success and failure are treated as in ImageCreate:
-/// On success, a new image is returned.
-/// (The caller is responsible for destroying the returned image!)
-/// On failure, returns NULL and errno/errCause are set accordingly.
-
-// Implementation hint: 
-// Call ImageCreate whenever you need a new image!
-
-/// Rotate an image.
-/// Returns a rotated version of the image.
-/// The rotation is 90 degrees anti-clockwise.
-///   img : the image to rotate.
-/// Requires: img must not be NULL.
-/// Ensures: The original img is not modified.
+/// Apply gamma correction to image.
+///   img : the image to modify.
+///   gamma : the exponent of the correction curve.
+/// Requires: img must not be NULL, gamma > 0.0.
 /// 
-/// On success, a new image is returned.
-/// (The caller is responsible for destroying the returned image!)
-/// On failure, returns NULL and errno/errCause are set accordingly.
-Image ImageRotate(Image img) { ///
+/// Each level v is set to maxval * (v/maxval)^gamma, rounded and saturated.
+/// This will brighten the midtones if gamma<1.0 and
+/// darken them if gamma>1.0.
+void ImageGamma(Image img, double gamma) { ///
   assert (img != NULL);
+  assert (gamma > 0.0);
 
-  const Image rotated = ImageCreate(img->height, img->width, img->maxval);
-  if (check(rotated == NULL, "Cannot allocate memory for rotated image")) {
-    return NULL;
+  const double maxval = (double)img->maxval;
+  uint8 lut[256];
+  for (int v = 0; v < 256; ++v) {
+    const double level = maxval * pow((double)v / maxval, gamma);
+    lut[v] = (uint8)clampDouble(level + 0.5, 0.0, maxval);
   }
+  ImageApplyLUT(img, lut);
+}
 
-  for (int y = 0; y < img->height; ++y) {
-    for (int x = 0; x < img->width; ++x) {
-      ImageSetPixel(rotated, y, rotated->height - 1 - x, ImageGetPixel(img, x, y));
-    }
+/// Adjust the levels of image.
+///   img : the image to modify.
+///   black, white : the levels to map to black (0) and white (maxval).
+/// Requires: img must not be NULL, black < white.
+/// 
+/// Levels in [black, white] are linearly mapped to [0, maxval],
+/// levels below black become 0 and levels above white become maxval.
+void ImageLevels(Image img, uint8 black, uint8 white) { ///
+  assert (img != NULL);
+  assert (black < white);
+
+  const double maxval = (double)img->maxval;
+  const double scale = maxval / (double)(white - black);
+  uint8 lut[256];
+  for (int v = 0; v < 256; ++v) {
+    const double level = (double)(v - black) * scale;
+    lut[v] = (uint8)clampDouble(level + 0.5, 0.0, maxval);
   }
-
-  return rotated;
+  ImageApplyLUT(img, lut);
 }
 
-/// Mirror an image = flip left-right.
-///   img : the image to mirror.
-/// Returns a mirrored version of the image.
+/// Stretch the contrast of image.
+///   img : the image to modify.
 /// Requires: img must not be NULL.
-/// Ensures: The original img is not modified.
 /// 
-/// On success, a new image is returned.
-/// (The caller is responsible for destroying the returned image!)
-/// On failure, returns NULL and errno/errCause are set accordingly.
-Image ImageMirror(Image img) { ///
+/// Linearly map the range of levels in the image to the full [0, maxval]
+/// range, as ImageLevels(img, min, max).
+/// If the image has a single level, it is not modified.
+void ImageContrastStretch(Image img) { ///
   assert (img != NULL);
 
-  const Image mirrored = ImageCreate(img->width, img->height, img->maxval);
-  if (check(mirrored == NULL, "Cannot allocate memory for mirrored image")) {
-    return NULL;
-  }
-
-  for (int y = 0; y < img->height; ++y) {
-    for (int x = 0; x < img->width; ++x) {
-      ImageSetPixel(mirrored, mirrored->width - 1 - x, y, ImageGetPixel(img, x, y));
-    }
+  uint8 min = PixMax;
+  uint8 max = 0;
+  ImageStats(img, &min, &max);
+  if (min < max) {
+    ImageLevels(img, min, max);
   }
-
-  return mirrored;
 }
 
-/// Crop a rectangular subimage from img.
+/// Fill a rectangle of image with a level.
+///   img : the image to modify.
+///   x, y, w, h : the top left corner coords and size of the rectangle.
+///   level : the level to set.
+/// Requires: img must not be NULL.
+///           The rectangle must be inside the image.
+///           level must not exceed the image maxval.
+void ImageFill(Image img, int x, int y, int w, int h, uint8 level) { ///
+  assert (img != NULL);
+  assert (ImageValidRect(img, x, y, w, h));
+  assert (level <= img->maxval);
+
+  if (w == 0 || h == 0) {
+    return;
+  }
+  if ((size_t)w == img->stride) {
+    memset(RowAt(img, x, y), level, (size_t)w * h);
+  } else {
+    for (int j = 0; j < h; ++j) {
+      memset(RowAt(img, x, y + j), level, (size_t)w);
+    }
+  }
+  COUNT_WRITES((size_t)w * h);
+}
+
+/// Geometric transformations
+
+/// These functions apply geometric transformations to an image,
+/// returning a new image as a result.
+/// 
+/// Success and failure are treated as in ImageCreate:
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+
+// Implementation hint: 
+// Call ImageCreate whenever you need a new image!
+
+// Orientation engine
+//
+// Rotations and flips by multiples of 90 degrees only move pixels around.
+// Each of them is described by three flags: whether rows and columns are
+// swapped (transpose), and whether the result is then flipped left-right
+// (flipx) and top-bottom (flipy).  Pixel (u, v) of the result comes from
+// pixel (a, b) of the original, or (b, a) if transposed, where
+//   a = flipx ? W'-1-u : u  and  b = flipy ? H'-1-v : v,
+// and W'xH' are the dimensions of the result.
+//
+// Without transpose, every row of the result is a whole row of the original,
+// possibly reversed.  With transpose, rows of the result are columns of the
+// original, so reading (or writing) along a row of one image jumps a full
+// row in the other.  To keep the working set in cache (and in the TLB), the
+// result is then built in square tiles of TILE x TILE pixels.
+
+#define TILE 64
+
+typedef struct {
+  Image img;
+  Image out;
+  int transpose, flipx, flipy;
+  const uint8* lut;     // levels of the result, or NULL to copy them
+} OrientJob;
+
+// Fill rows [y0, y1) of the result, without transpose.
+static void orientRowsBand(void* arg, int band, int y0, int y1) {
+  const OrientJob* job = (const OrientJob*)arg;
+  const uint8* lut = job->lut;
+  const int w = job->out->width;
+  for (int v = y0; v < y1; ++v) {
+    const uint8* row = Row(job->img, job->flipy ? job->out->height - 1 - v : v);
+    uint8* out = Row(job->out, v);
+    if (lut != NULL) {
+      if (job->flipx) {
+        for (int u = 0; u < w; ++u) {
+          out[u] = lut[row[w - 1 - u]];
+        }
+      } else {
+        for (int u = 0; u < w; ++u) {
+          out[u] = lut[row[u]];
+        }
+      }
+    } else if (job->flipx) {
+      for (int u = 0; u < w; ++u) {
+        out[u] = row[w - 1 - u];
+      }
+    } else {
+      memcpy(out, row, (size_t)w);
+    }
+    COUNT_READS(w);
+    COUNT_WRITES(w);
+  }
+}
+
+// Fill rows [y0, y1) of the result, with transpose, tile by tile.
+static void orientTilesBand(void* arg, int band, int y0, int y1) {
+  const OrientJob* job = (const OrientJob*)arg;
+  const uint8* lut = job->lut;
+  const int w = job->out->width;
+  const int h = job->out->height;
+  for (int v0 = y0; v0 < y1; v0 += TILE) {
+    const int v1 = minInt(v0 + TILE, y1);
+    for (int u0 = 0; u0 < w; u0 += TILE) {
+      const int u1 = minInt(u0 + TILE, w);
+      // Row a of the original holds pixels (u, v0..v1-1) of the result.
+      for (int u = u0; u < u1; ++u) {
+        const uint8* row = Row(job->img, job->flipx ? w - 1 - u : u);
+        if (lut != NULL) {
+          for (int v = v0; v < v1; ++v) {
+            Row(job->out, v)[u] = lut[row[job->flipy ? h - 1 - v : v]];
+          }
+        } else {
+          for (int v = v0; v < v1; ++v) {
+            Row(job->out, v)[u] = row[job->flipy ? h - 1 - v : v];
+          }
+        }
+      }
+      COUNT_READS((u1 - u0) * (v1 - v0));
+      COUNT_WRITES((u1 - u0) * (v1 - v0));
+    }
+  }
+}
+
+// Create the transformed image (see Orientation engine, above).
+// If lut is not NULL, levels are mapped through it on the way.
+static Image orient(Image img, int transpose, int flipx, int flipy, const uint8* lut) {
+  const int w = transpose ? img->height : img->width;
+  const int h = transpose ? img->width : img->height;
+  // No need to zero the pixels: the band kernels write every one.
+  const Image out = imageNew(w, h, img->maxval, 0);
+  if (out == NULL) {
+    return NULL;
+  }
+  COUNT_WRITES((size_t)w * h);  // as ImageCreate does, to keep the totals
+
+  OrientJob job = { .img = img, .out = out,
+                    .transpose = transpose, .flipx = flipx, .flipy = flipy,
+                    .lut = lut };
+  ForBands(h, numBands(h), transpose ? orientTilesBand : orientRowsBand, &job);
+  return out;
+}
+
+/// Rotate an image.
+/// Returns a rotated version of the image.
+/// The rotation is 90 degrees anti-clockwise.
+///   img : the image to rotate.
+/// Requires: img must not be NULL.
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRotate(Image img) { ///
+  assert (img != NULL);
+  // Pixel (x, y) goes to (y, width-1-x).
+  return orient(img, 1, 0, 1, NULL);
+}
+
+/// Rotate an image clockwise.
+/// Returns a version of the image rotated 90 degrees clockwise.
+///   img : the image to rotate.
+/// Requires: img must not be NULL.
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRotateCW(Image img) { ///
+  assert (img != NULL);
+  // Pixel (x, y) goes to (height-1-y, x).
+  return orient(img, 1, 1, 0, NULL);
+}
+
+/// Rotate an image by 180 degrees.
+///   img : the image to rotate.
+/// Requires: img must not be NULL.
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRotate180(Image img) { ///
+  assert (img != NULL);
+  // Pixel (x, y) goes to (width-1-x, height-1-y).
+  return orient(img, 0, 1, 1, NULL);
+}
+
+/// Mirror an image = flip left-right.
+///   img : the image to mirror.
+/// Returns a mirrored version of the image.
+/// Requires: img must not be NULL.
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageMirror(Image img) { ///
+  assert (img != NULL);
+  // Pixel (x, y) goes to (width-1-x, y).
+  return orient(img, 0, 1, 0, NULL);
+}
+
+/// Flip an image top-bottom.
+///   img : the image to flip.
+/// Returns a vertically flipped version of the image.
+/// Requires: img must not be NULL.
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageFlipVertical(Image img) { ///
+  assert (img != NULL);
+  // Pixel (x, y) goes to (x, height-1-y).
+  return orient(img, 0, 0, 1, NULL);
+}
+
+/// Transform an image: reorient it and map its levels, in a single pass.
+///   img : the image to transform.
+///   transpose, flipx, flipy : the orientation of the result.
+///   lut : the table of new levels, indexed by old level, or NULL.
+/// Returns an image where pixel (u, v) has level lut[L] (or L, if lut is
+/// NULL), where L is the level of pixel (a, b) of img, or (b, a) if
+/// transpose is nonzero, with
+///   a = flipx ? W'-1-u : u  and  b = flipy ? H'-1-v : v,
+/// and W'xH' the dimensions of the result.
+/// So ImageTransform(img, 1, 0, 1, NULL) is ImageRotate(img), for instance,
+/// and ImageTransform(img, 0, 0, 0, lut) is a copy of img with ImageApplyLUT
+/// applied.  Chains of those operations may be composed into one transform.
+/// Requires: img must not be NULL,
+///           lut entries must not exceed img maxval.
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageTransform(Image img, int transpose, int flipx, int flipy, const uint8 lut[256]) { ///
+  assert (img != NULL);
+  return orient(img, transpose != 0, flipx != 0, flipy != 0, lut);
+}
+
+// Copy a w x h rectangle of pixels from (sx, sy) in src to (dx, dy) in dst.
+// This uses one memcpy per row, or a single one if the rows of the
+// rectangle are contiguous in both images.
+static void copyRect(Image dst, int dx, int dy, Image src, int sx, int sy, int w, int h) {
+  if (w == 0 || h == 0) {
+    return;
+  }
+  if ((size_t)w == src->stride && (size_t)w == dst->stride) {
+    memcpy(RowAt(dst, dx, dy), RowAt(src, sx, sy), (size_t)w * h);
+  } else {
+    for (int j = 0; j < h; ++j) {
+      memcpy(RowAt(dst, dx, dy + j), RowAt(src, sx, sy + j), (size_t)w);
+    }
+  }
+  COUNT_READS((size_t)w * h);
+  COUNT_WRITES((size_t)w * h);
+}
+
+/// Crop a rectangular subimage from img.
 /// The rectangle is specified by the top left corner coords (x, y) and
 /// width w and height h.
 /// Requires:
@@ -585,21 +1403,90 @@ Image ImageCrop(Image img, int x, int y, int w, int h) { ///
   assert (img != NULL);
   assert (ImageValidRect(img, x, y, w, h));
 
-  const Image cropped = ImageCreate(w, h, img->maxval);
-  if (check(cropped == NULL, "Cannot allocate memory for cropped image")) {
+  // No need to zero the pixels: copyRect writes every one.
+  const Image cropped = imageNew(w, h, img->maxval, 0);
+  if (!check(cropped != NULL, "Cannot allocate memory for cropped image")) {
     return NULL;
   }
+  COUNT_WRITES((size_t)w * h);  // as ImageCreate does, to keep the totals
 
-  for (int j = 0; j < h; ++j) {
-    for (int i = 0; i < w; ++i) {
-      ImageSetPixel(cropped, i, j, ImageGetPixel(img, x + i, y + j));
-    }
-  }
+  copyRect(cropped, 0, 0, img, x, y, w, h);
 
   assert (cropped->width == w && cropped->height == h);
   return cropped;
 }
 
+/// Create a view of a rectangular subimage of img.
+/// The rectangle is specified by the top left corner coords (x, y) and
+/// width w and height h.
+/// Requires:
+///   img must not be NULL.
+///   The rectangle must be inside the original image.
+/// Ensures:
+///   The returned image has width w and height h.
+///   The returned image shares its pixels with img: changes to the pixels of
+///   one are seen in the other.
+/// 
+/// No pixels are copied, so this takes constant time.
+/// The view remains valid even after img is destroyed.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageCropView(Image img, int x, int y, int w, int h) { ///
+  assert (img != NULL);
+  assert (ImageValidRect(img, x, y, w, h));
+
+  const Image view = (Image)malloc(sizeof(struct image));
+  if (!check(view != NULL, "Cannot allocate memory for view")) {
+    return NULL;
+  }
+  *view = *img;
+  view->width = w;
+  view->height = h;
+  view->offset = img->offset + (size_t)y * img->stride + (size_t)x;
+  atomic_fetch_add(&img->raster->refs, 1);
+
+  assert (view->width == w && view->height == h);
+  return view;
+}
+
+/// Give img a compact copy of its pixels.
+/// If img is a view (or is viewed by other images), its pixels are copied
+/// to a new pixel array owned by img alone, so later changes to img are no
+/// longer seen by the other images, and vice-versa.
+/// Otherwise, nothing is done.
+/// Requires: img must not be NULL.
+/// 
+/// On success, returns nonzero.
+/// On failure, returns 0, img is not modified, and errno/errCause are set.
+int ImageMaterialize(Image img) { ///
+  assert (img != NULL);
+
+  // Already compact if img alone uses a raster holding exactly its pixels
+  // (a view may outlive its parent and keep a larger raster).
+  const struct raster* raster = img->raster;
+  size_t size = raster->size;
+  if (raster->map != NULL) {
+    size -= (size_t)(raster->data - (uint8*)raster->map);
+  }
+  if (atomic_load(&raster->refs) == 1 && img->offset == 0 &&
+      img->stride == (size_t)img->width &&
+      size == (size_t)img->width * (size_t)img->height) {
+    return 1;
+  }
+  Image copy = ImageCrop(img, 0, 0, img->width, img->height);
+  if (copy == NULL) {
+    return 0;
+  }
+  // Swap the contents of img and copy, then destroy the old contents.
+  const struct image old = *img;
+  *img = *copy;
+  *copy = old;
+  ImageDestroy(&copy);
+  return 1;
+}
+
 /// Operations on two images
 
 /// Paste an image into a larger image.
@@ -613,12 +1500,7 @@ void ImagePaste(Image img1, int x, int y, Image img2) { ///
   assert (img2 != NULL);
   assert (ImageValidRect(img1, x, y, img2->width, img2->height));
 
-  for (int j = 0; j < img2->height; ++j) {
-    for (int i = 0; i < img2->width; ++i) {
-      const uint8 pixel = ImageGetPixel(img2, i, j);
-      ImageSetPixel(img1, x + i, y + j, pixel);
-    }
-  }
+  copyRect(img1, x, y, img2, 0, 0, img2->width, img2->height);
 }
 
 /// Blend an image into a larger image.
@@ -629,22 +1511,33 @@ void ImagePaste(Image img1, int x, int y, Image img2) { ///
 /// Ensures: img2 is not modified,
 /// alpha usually is in [0.0, 1.0], but values outside that interval
 /// may provide interesting effects.  Over/underflows should saturate.
+typedef struct {
+  Image img1;
+  Image img2;
+  int x, y;
+  double alpha;
+} BlendJob;
+
+static void blendBand(void* arg, int b, int y0, int y1) {
+  const BlendJob* job = (const BlendJob*)arg;
+  const int w = job->img2->width;
+  for (int j = y0; j < y1 && w > 0; ++j) {
+    // Each level is (1-alpha)*pixel1 + alpha*pixel2, rounded by adding 0.5
+    // just like in ImageBrighten, and saturated.
+    kernels->blend(RowAt(job->img1, job->x, job->y + j), Row(job->img2, j), (size_t)w,
+                   job->alpha, (uint8)job->img1->maxval);
+    COUNT_READS(2 * w);
+    COUNT_WRITES(w);
+  }
+}
+
 void ImageBlend(Image img1, int x, int y, Image img2, double alpha) { ///
   assert (img1 != NULL);
   assert (img2 != NULL);
   assert (ImageValidRect(img1, x, y, img2->width, img2->height));
 
-  for (int j = 0; j < img2->height; ++j) {
-    for (int i = 0; i < img2->width; ++i) {
-      const uint8 pixel1 = ImageGetPixel(img1, x + i, y + j);
-      const uint8 pixel2 = ImageGetPixel(img2, i, j);
-      const double blendedPixel = (1 - alpha) * (double)pixel1 + alpha * (double)pixel2;
-
-      // Add 0.5 to pixel value just like in ImageBrighten.
-      const uint8 level = (uint8)clampDouble(blendedPixel + 0.5, 0.0, (double)img1->maxval);
-      ImageSetPixel(img1, x + i, y + j, level);
-    }
-  }
+  BlendJob job = { .img1 = img1, .img2 = img2, .x = x, .y = y, .alpha = alpha };
+  ForBands(img2->height, numBands(img2->height), blendBand, &job);
 }
 
 /// Compare an image to a subimage of a larger image.
@@ -657,18 +1550,198 @@ int ImageMatchSubImage(Image img1, int x, int y, Image img2) { ///
   assert (img2 != NULL);
   assert (ImageValidPos(img1, x, y));
 
-  for (int j = 0; j < minInt(img1->height - y, img2->height); ++j) {
-    for (int i = 0; i < minInt(img1->width - x, img2->width); ++i) {
-      PIXCOMP += 1;
-      if (ImageGetPixel(img1, x + i, y + j) != ImageGetPixel(img2, i, j)) {
-        return 0;
+  const int w = minInt(img1->width - x, img2->width);
+  const int h = minInt(img1->height - y, img2->height);
+  for (int j = 0; j < h && w > 0; ++j) {
+    const uint8* row1 = RowAt(img1, x, y + j);
+    const uint8* row2 = Row(img2, j);
+    int i = 0;
+    while (i < w && row1[i] == row2[i]) {
+      ++i;
+    }
+    // Count the comparisons made, including the failed one.
+    const int compared = i < w ? i + 1 : w;
+    COUNT(PIXCOMP, compared);
+    COUNT_READS(2 * compared);
+    if (i < w) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+// Search engine
+//
+// Checking every position with ImageMatchSubImage costs O(W*H*w*h) in the
+// worst case, which happens when most candidates fail late (on flat or
+// repetitive images, for instance).
+// Instead, the search computes a rolling hash (Rabin-Karp) of the w x h
+// window at every position, and only compares pixels where the hash equals
+// the hash of the subimage.  Hashes are polynomials, with arithmetic modulo
+// 2^64 (uint64_t overflow):
+//   the hash of a row of w pixels p[0..w-1] is  sum p[i] * RB^(w-1-i),
+//   the hash of a window is  sum rowhash[j] * CB^(h-1-j)  over its h rows.
+// The row hashes at positions x = 0, 1, ... are computed by rolling, in O(1)
+// each, and so are the window hashes at rows y = 0, 1, ..., by removing the
+// top row hash and appending the next one.  So each row costs O(W), and the
+// whole search O(W*H), plus the comparisons of (rare) false hash hits.
+//
+// Positions are visited in raster order, so the first match found is the
+// first in raster order, as required.
+
+#define RB 0x100000001b3ull      // base for row hashes (odd)
+#define CB 0x9e3779b97f4a7c15ull // base for column hashes (odd)
+
+// b^e modulo 2^64
+static uint64_t powHash(uint64_t b, int e) {
+  uint64_t r = 1;
+  while (e-- > 0) {
+    r *= b;
+  }
+  return r;
+}
+
+// Hashes of the n = W-w+1 windows of width w in a row of W pixels.
+//   rbw : RB^(w-1)
+static void rowHashes(const uint8* row, int w, int n, uint64_t rbw, uint64_t* out) {
+  uint64_t hash = 0;
+  for (int i = 0; i < w; ++i) {
+    hash = hash * RB + row[i];
+  }
+  out[0] = hash;
+  for (int x = 1; x < n; ++x) {
+    hash = (hash - row[x - 1] * rbw) * RB + row[x - 1 + w];
+    out[x] = hash;
+  }
+}
+
+// Hash of a whole image (as a window of itself).
+static uint64_t imageHash(Image img) {
+  uint64_t hash = 0;
+  for (int j = 0; j < img->height && img->width > 0; ++j) {
+    uint64_t rh;
+    rowHashes(Row(img, j), img->width, 1, 0, &rh);
+    hash = hash * CB + rh;
+    COUNT_READS(img->width);
+  }
+  return hash;
+}
+
+// A search of img2 in img1, split in bands of rows of positions.
+// Each band visits its positions in raster order, and calls match() for
+// each matching position.  The search of the band stops if match() returns
+// nonzero, or if stop() returns nonzero (which is checked before each row y).
+typedef struct Search Search;
+struct Search {
+  Image img1;
+  Image img2;
+  uint64_t hash;  // hash of img2
+  int nbands;
+  int (*match)(Search* search, int b, int x, int y);
+  int (*stop)(Search* search, int b, int y);
+  void* state;    // state of the particular search
+};
+
+// Search positions of band b, with y in [y0, y1), checking every position.
+static void searchBandAll(Search* search, int b, int y0, int y1) {
+  const int n = search->img1->width - search->img2->width + 1;
+  for (int y = y0; y < y1 && !search->stop(search, b, y); ++y) {
+    for (int x = 0; x < n; ++x) {
+      if (ImageMatchSubImage(search->img1, x, y, search->img2) &&
+          search->match(search, b, x, y)) {
+        return;
+      }
+    }
+  }
+}
+
+// Search positions of band b, with y in [y0, y1), using rolling hashes.
+static void searchBand(void* arg, int b, int y0, int y1) {
+  Search* search = (Search*)arg;
+  const Image img1 = search->img1;
+  const int w = search->img2->width;
+  const int h = search->img2->height;
+  const int n = img1->width - w + 1;  // positions per row
+
+  // Window hashes, and row hashes, at each position of the current row.
+  uint64_t* hashes = (uint64_t*)malloc(2 * (size_t)n * sizeof(uint64_t));
+  if (hashes == NULL || w == 0 || h == 0) {
+    // No memory (or nothing to hash): check every position.
+    free(hashes);
+    searchBandAll(search, b, y0, y1);
+    return;
+  }
+  uint64_t* rh = hashes + n;
+  const uint64_t rbw = powHash(RB, w - 1);
+  const uint64_t cbh = powHash(CB, h - 1);
+
+  // Hashes of the windows at row y0.
+  for (int x = 0; x < n; ++x) {
+    hashes[x] = 0;
+  }
+  for (int j = 0; j < h; ++j) {
+    rowHashes(Row(img1, y0 + j), w, n, rbw, rh);
+    for (int x = 0; x < n; ++x) {
+      hashes[x] = hashes[x] * CB + rh[x];
+    }
+    COUNT_READS(img1->width);
+  }
+
+  for (int y = y0; y < y1 && !search->stop(search, b, y); ++y) {
+    for (int x = 0; x < n; ++x) {
+      if (hashes[x] == search->hash && ImageMatchSubImage(img1, x, y, search->img2) &&
+          search->match(search, b, x, y)) {
+        free(hashes);
+        return;
+      }
+    }
+    // Roll down: remove row y, append row y+h.
+    if (y + 1 < y1) {
+      rowHashes(Row(img1, y), w, n, rbw, rh);
+      for (int x = 0; x < n; ++x) {
+        hashes[x] -= rh[x] * cbh;
       }
+      rowHashes(Row(img1, y + h), w, n, rbw, rh);
+      for (int x = 0; x < n; ++x) {
+        hashes[x] = hashes[x] * CB + rh[x];
+      }
+      COUNT_READS(2 * img1->width);
     }
   }
+  free(hashes);
+}
+
+// Run search on all positions of img2 in img1.
+static void runSearch(Search* search) {
+  ForBands(search->img1->height - search->img2->height + 1, search->nbands,
+           searchBand, search);
+}
 
+// State of ImageLocateSubImage
+typedef struct {
+  atomic_int found;  // first band with a match (nbands if none yet)
+  struct { int x, y; } *pos, pos1;  // first match in each band
+} Locate;
+
+// Record the first match of band b, and stop the band.
+static int locateMatch(Search* search, int b, int x, int y) {
+  Locate* locate = (Locate*)search->state;
+  locate->pos[b].x = x;
+  locate->pos[b].y = y;
+  int found = atomic_load(&locate->found);
+  while (b < found && !atomic_compare_exchange_weak(&locate->found, &found, b)) {
+  }
   return 1;
 }
 
+// As soon as a band finds a match, the bands after it may stop: their
+// matches would come later in raster order.
+static int locateStop(Search* search, int b, int y) {
+  Locate* locate = (Locate*)search->state;
+  return atomic_load(&locate->found) < b;
+}
+
 /// Locate a subimage inside another image.
 /// Searches for img2 inside img1.
 /// Requires: img1, img2, px and py  must not be NULL.
@@ -683,22 +1756,760 @@ int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) { ///
   assert (px != NULL);
   assert (py != NULL);
 
-  for (int j = 0; j <= img1->height - img2->height; ++j) {
-    for (int i = 0; i <= img1->width - img2->width; ++i) {
-      if (ImageMatchSubImage(img1, i, j, img2)) {
-        *px = i;
-        *py = j;
-        return 1;
+  Locate locate;
+  Search search = { .img1 = img1, .img2 = img2, .match = locateMatch,
+                    .stop = locateStop, .state = &locate };
+  search.nbands = numBands(img1->height - img2->height + 1);
+  locate.pos = search.nbands > 1 ? calloc((size_t)search.nbands, sizeof(*locate.pos)) : NULL;
+  if (locate.pos == NULL) {
+    search.nbands = 1;
+    locate.pos = &locate.pos1;
+  }
+  atomic_init(&locate.found, search.nbands);
+  search.hash = imageHash(img2);
+  runSearch(&search);
+
+  const int found = atomic_load(&locate.found);
+  if (found < search.nbands) {
+    *px = locate.pos[found].x;
+    *py = locate.pos[found].y;
+  }
+  if (locate.pos != &locate.pos1) {
+    free(locate.pos);
+  }
+  return found < search.nbands;
+}
+
+// State of ImageLocateAll
+//
+// Matches must be reported in raster order, one at a time.  Only the band
+// whose turn it is (current) reports its matches, directly, as it finds
+// them.  Later bands keep theirs in a list, reported when the bands before
+// them are done.  To bound memory, a band stops (at the end of a row) when
+// its list holds LIST_MAX matches, and the rest of it is searched later,
+// serially, in its turn.  A band also stops when the bands before it have
+// already found max matches.
+#define LIST_MAX 4096
+
+typedef struct {
+  ImageMatchFn found;  // callback
+  void* arg;
+  size_t max;          // maximum number of matches to report
+  size_t count;        // matches reported so far (by the current band)
+  atomic_int current;  // band whose matches are being reported
+  atomic_int halt;     // set to stop all bands (max reached, or failure)
+  int failed;          // set if a list could not grow
+  int overflow;        // set if there were more than INT_MAX matches
+  pthread_mutex_t lock;  // protects done, and the lists of done bands
+  struct Matches {     // matches of each band
+    size_t n, size;    // number of matches in the list, and allocated size
+    struct { int x, y; } *pos;
+    atomic_size_t nfound;  // matches found by the band (listed or reported)
+    int y1;            // end of the band
+    int resume;        // first row not searched yet, if stopped early (or y1)
+    int done;          // has the band finished?
+  } *bands, band1;
+} LocateAll;
+
+// Report a match, in the turn of its band.  Returns nonzero to stop.
+static int reportMatch(LocateAll* all, int x, int y) {
+  if (all->count == (size_t)INT_MAX) {
+    all->overflow = 1;
+    atomic_store(&all->halt, 1);
+    return 1;
+  }
+  all->found(x, y, all->arg);
+  if (++all->count >= all->max) {
+    atomic_store(&all->halt, 1);
+    return 1;
+  }
+  return 0;
+}
+
+// Report the list of matches of band m, in its turn, and empty it.
+static void reportList(LocateAll* all, struct Matches* m) {
+  for (size_t k = 0; k < m->n && !atomic_load(&all->halt); ++k) {
+    reportMatch(all, m->pos[k].x, m->pos[k].y);
+  }
+  free(m->pos);
+  m->pos = NULL;
+  m->n = m->size = 0;
+}
+
+// Report a match directly, if it is the turn of band b, or append it to
+// the list of the band.
+static int locateAllMatch(Search* search, int b, int x, int y) {
+  LocateAll* all = (LocateAll*)search->state;
+  struct Matches* m = &all->bands[b];
+  atomic_fetch_add(&m->nfound, 1);
+  if (atomic_load(&all->current) == b) {
+    reportList(all, m);
+    return reportMatch(all, x, y) || atomic_load(&all->halt);
+  }
+  if (m->n == m->size) {
+    const size_t size = m->size > 0 ? 2 * m->size : 64;
+    void* pos = realloc(m->pos, size * sizeof(*m->pos));
+    if (pos == NULL) {
+      all->failed = 1;
+      atomic_store(&all->halt, 1);
+      return 1;
+    }
+    m->pos = pos;
+    m->size = size;
+  }
+  m->pos[m->n].x = x;
+  m->pos[m->n].y = y;
+  m->n++;
+  return 0;
+}
+
+// Stop band b before row y if all bands must stop, if its list is full, or
+// if the bands before it have found max matches.
+static int locateAllStop(Search* search, int b, int y) {
+  LocateAll* all = (LocateAll*)search->state;
+  if (atomic_load(&all->halt)) {
+    return 1;
+  }
+  struct Matches* m = &all->bands[b];
+  if (atomic_load(&all->current) != b && m->n >= LIST_MAX) {
+    m->resume = y;
+    return 1;
+  }
+  size_t before = 0;
+  for (int c = 0; c < b; ++c) {
+    before += atomic_load(&all->bands[c].nfound);
+  }
+  return before >= all->max;
+}
+
+// Search band b, and pass the turn on when it is done.
+static void locateAllBand(void* arg, int b, int y0, int y1) {
+  Search* search = (Search*)arg;
+  LocateAll* all = (LocateAll*)search->state;
+  searchBand(search, b, y0, y1);
+
+  pthread_mutex_lock(&all->lock);
+  all->bands[b].done = 1;
+  // Report the bands done after b, up to one stopped early, or still running.
+  int c = atomic_load(&all->current);
+  if (c == b) {
+    while (c < search->nbands && all->bands[c].done) {
+      reportList(all, &all->bands[c]);
+      if (all->bands[c].resume < all->bands[c].y1) {
+        break;
       }
+      c++;
     }
+    atomic_store(&all->current, c);
   }
+  pthread_mutex_unlock(&all->lock);
+}
 
-  return 0;
+/// Locate all occurrences of a subimage inside another image.
+/// Searches for img2 inside img1, and calls found(x, y, arg) for each
+/// matching position (x, y), in raster order, one call at a time (from the
+/// calling thread, or from one of the threads of the search).
+///   max : maximum number of matches to report (0 or less means no limit).
+/// Requires: img1, img2 and found must not be NULL.
+///           img2 must fit inside img1.
+/// Ensures: The images are not modified.
+/// 
+/// Returns the number of matches reported, or -1 if memory could not be
+/// allocated, or there are more than INT_MAX matches (errCause is set).
+int ImageLocateAll(Image img1, Image img2, ImageMatchFn found, void* arg, int max) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  assert (ImageValidRect(img1, 0, 0, img2->width, img2->height));
+  assert (found != NULL);
+
+  LocateAll all = { .found = found, .arg = arg, .max = max > 0 ? (size_t)max : SIZE_MAX,
+                    .lock = PTHREAD_MUTEX_INITIALIZER };
+  Search search = { .img1 = img1, .img2 = img2, .match = locateAllMatch,
+                    .stop = locateAllStop, .state = &all };
+  const int h = img1->height - img2->height + 1;
+  search.nbands = numBands(h);
+  all.bands = search.nbands > 1 ? calloc((size_t)search.nbands, sizeof(*all.bands)) : NULL;
+  if (all.bands == NULL) {
+    search.nbands = 1;
+    all.bands = &all.band1;
+  }
+  for (int b = 0; b < search.nbands; ++b) {
+    atomic_init(&all.bands[b].nfound, 0);
+    all.bands[b].y1 = all.bands[b].resume = bandStart(h, search.nbands, b + 1);
+  }
+  atomic_init(&all.current, 0);
+  atomic_init(&all.halt, 0);
+  search.hash = imageHash(img2);
+  ForBands(h, search.nbands, locateAllBand, &search);
+
+  // Search the rest of the bands stopped early, in turn.
+  for (int c = atomic_load(&all.current); c < search.nbands; ++c) {
+    atomic_store(&all.current, c);
+    struct Matches* m = &all.bands[c];
+    reportList(&all, m);
+    if (m->resume < m->y1 && !atomic_load(&all.halt)) {
+      const int y0 = m->resume;
+      m->resume = m->y1;
+      searchBand(&search, c, y0, m->y1);
+    }
+  }
+
+  for (int b = 0; b < search.nbands; ++b) {
+    free(all.bands[b].pos);
+  }
+  if (all.bands != &all.band1) {
+    free(all.bands);
+  }
+  if (all.overflow) {
+    errno = EOVERFLOW;
+    check(0, "Too many matches");
+    return -1;
+  }
+  return check(!all.failed, "Cannot allocate memory for matches") ? (int)all.count : -1;
+}
+
+// Approximate matching
+//
+// ImageLocateBest scores every position (x, y) of img2 in img1, comparing
+// img2 with the w x h window of img1 at (x, y):
+//   SAD = sum |a - t|  over the pixels a of the window and t of img2;
+//   NCC = sum (a-ma)(t-mt) / sqrt(sum (a-ma)^2 * sum (t-mt)^2),
+//   where ma and mt are the mean levels of the window and of img2.
+// The sums of a and a^2 over any window are read in O(1) from integral
+// images (summed-area tables) of img1.  So, for NCC, only sum a*t needs the
+// pixels.  For SAD, |sum a - sum t| is a lower bound of the SAD, which
+// rejects many positions without reading their pixels, and the SAD itself
+// is abandoned as soon as it exceeds the score to beat.  The integral
+// images are kept modulo 2^32 (4 bytes per entry) when no window sum can
+// reach 2^32, since then the window sums computed from them are exact.
+//
+// Scoring every position still costs O(W*H*w*h).  So, for large subimages,
+// the search builds a pyramid of images, each half the size of the one
+// below (averaging 2x2 blocks), and only scores every position at the top
+// (coarsest) level, keeping the NBEST best ones.  Then, at each level down,
+// it scores the positions around the candidates of the level above, and
+// keeps the best ones, down to full resolution.  This is a heuristic: the
+// best position may be lost, if it does not stand out at low resolution.
+// Only the top level needs integral images: the few positions scored at
+// the levels below get their window sums from the pixels, in the same pass
+// as sum a*t.
+
+#define PYRAMID_LEVELS 4  // maximum number of levels above full resolution
+#define PYRAMID_MIN 16    // minimum size of img2 in a level above full resolution
+#define NBEST 32          // candidates kept at each level above full resolution
+#define REFINE 2          // positions scored around a candidate, in each direction
+
+// A level of the pyramid
+typedef struct {
+  Image img1;
+  Image img2;
+  void* sum;          // integral image of img1 (or NULL): sum[y*(W+1)+x] =
+                      // sum of pixels above and to the left of (x, y)
+  void* sq;           // integral image of the squares of the pixels of img1
+  int wide;           // are the entries uint64_t (or uint32_t)?
+  size_t iisize;      // bytes of each integral image
+  uint64_t sum2, sq2; // sum of the pixels of img2, and of their squares
+} Level;
+
+// A candidate position and its cost (lower is better).
+typedef struct {
+  double cost;
+  int x, y;
+} Candidate;
+
+// The best candidates found, sorted by cost, then in raster order.
+typedef struct {
+  int n;     // number of candidates
+  int size;  // maximum number of candidates
+  Candidate c[NBEST];
+} Best;
+
+// Half-size version of img, where each pixel is the mean of a 2x2 block.
+static Image halve(Image img) {
+  // No need to zero the pixels: they are all written below.
+  Image half = imageNew(img->width / 2, img->height / 2, img->maxval, 0);
+  if (half == NULL) {
+    return NULL;
+  }
+  COUNT_WRITES((size_t)half->width * half->height);  // as ImageCreate does
+  for (int y = 0; y < half->height; ++y) {
+    const uint8* row0 = Row(img, 2 * y);
+    const uint8* row1 = Row(img, 2 * y + 1);
+    uint8* out = Row(half, y);
+    for (int x = 0; x < half->width; ++x) {
+      out[x] = (uint8)((row0[2*x] + row0[2*x+1] + row1[2*x] + row1[2*x+1] + 2) / 4);
+    }
+    COUNT_READS(4 * half->width);
+    COUNT_WRITES(half->width);
+  }
+  return half;
+}
+
+// Compute the sums of lv->img2 and, if integrals is set, the integral
+// images of lv->img1.
+// Returns 0 if there is not enough memory (errno is set).
+static int levelInit(Level* lv, int integrals) {
+  const Image img2 = lv->img2;
+  lv->sum2 = lv->sq2 = 0;
+  for (int y = 0; y < img2->height; ++y) {
+    const uint8* row = Row(img2, y);
+    for (int x = 0; x < img2->width; ++x) {
+      lv->sum2 += row[x];
+      lv->sq2 += (uint64_t)row[x] * row[x];
+    }
+    COUNT_READS(img2->width);
+  }
+  if (!integrals) {
+    return 1;
+  }
+
+  // Window sums of squares are at most PixMax^2 * w * h.
+  const Image img1 = lv->img1;
+  lv->wide = (uint64_t)PixMax * PixMax * (uint64_t)img2->width * (uint64_t)img2->height
+             > UINT32_MAX;
+  const size_t entry = lv->wide ? sizeof(uint64_t) : sizeof(uint32_t);
+  const size_t s = (size_t)img1->width + 1;
+  if ((size_t)img1->height + 1 > SIZE_MAX / s / entry) {
+    errno = ENOMEM;
+    return 0;
+  }
+  lv->iisize = s * ((size_t)img1->height + 1) * entry;
+  lv->sum = bufferAlloc(lv->iisize, 0);
+  lv->sq = bufferAlloc(lv->iisize, 0);
+  if (lv->sum == NULL || lv->sq == NULL) {
+    return 0;
+  }
+  memset(lv->sum, 0, s * entry);
+  memset(lv->sq, 0, s * entry);
+  for (int y = 0; y < img1->height; ++y) {
+    const uint8* row = Row(img1, y);
+    const size_t i = (size_t)(y + 1) * s;
+    uint64_t rowsum = 0, rowsq = 0;
+    if (lv->wide) {
+      uint64_t* sum = (uint64_t*)lv->sum + i;
+      uint64_t* sq = (uint64_t*)lv->sq + i;
+      sum[0] = sq[0] = 0;
+      for (int x = 0; x < img1->width; ++x) {
+        rowsum += row[x];
+        rowsq += (uint64_t)row[x] * row[x];
+        sum[x + 1] = sum[x + 1 - s] + rowsum;
+        sq[x + 1] = sq[x + 1 - s] + rowsq;
+      }
+    } else {
+      // modulo 2^32
+      uint32_t* sum = (uint32_t*)lv->sum + i;
+      uint32_t* sq = (uint32_t*)lv->sq + i;
+      sum[0] = sq[0] = 0;
+      for (int x = 0; x < img1->width; ++x) {
+        rowsum += row[x];
+        rowsq += (uint64_t)row[x] * row[x];
+        sum[x + 1] = sum[x + 1 - s] + (uint32_t)rowsum;
+        sq[x + 1] = sq[x + 1 - s] + (uint32_t)rowsq;
+      }
+    }
+    COUNT_READS(img1->width);
+  }
+  return 1;
+}
+
+// Release the integral images of lv.
+static void levelFree(Level* lv) {
+  bufferFree(lv->sum, lv->iisize);
+  bufferFree(lv->sq, lv->iisize);
+  lv->sum = lv->sq = NULL;
+}
+
+// Sum over the window of img2 at (x, y), from integral image ii of lv.
+static uint64_t windowSum(const Level* lv, const void* ii, int x, int y) {
+  const size_t s = (size_t)lv->img1->width + 1;
+  const size_t top = (size_t)y * s + (size_t)x;
+  const size_t bottom = top + (size_t)lv->img2->height * s;
+  const int w = lv->img2->width;
+  if (lv->wide) {
+    const uint64_t* p = (const uint64_t*)ii;
+    return p[bottom + w] - p[top + w] - p[bottom] + p[top];
+  }
+  const uint32_t* p = (const uint32_t*)ii;
+  return (uint32_t)(p[bottom + w] - p[top + w] - p[bottom] + p[top]);
+}
+
+// Cost of img2 at position (x, y) of level lv: the SAD, or minus the NCC
+// (so that lower is better for both).  The SAD may be abandoned as soon as
+// it exceeds bound, returning some cost above bound.
+static double matchCost(const Level* lv, ImageMatchMethod method, int x, int y,
+                        double bound) {
+  const Image img1 = lv->img1;
+  const Image img2 = lv->img2;
+  const int w = img2->width;
+  const int h = img2->height;
+
+  if (method == IMAGE_MATCH_SAD) {
+    if (lv->sum != NULL) {
+      const uint64_t sum1 = windowSum(lv, lv->sum, x, y);
+      const double lower = sum1 > lv->sum2 ? (double)(sum1 - lv->sum2) : (double)(lv->sum2 - sum1);
+      if (lower > bound) {
+        return lower;
+      }
+    }
+    uint64_t sad = 0;
+    for (int j = 0; j < h; ++j) {
+      const uint8* row1 = RowAt(img1, x, y + j);
+      const uint8* row2 = Row(img2, j);
+      for (int i = 0; i < w; ++i) {
+        const int d = row1[i] - row2[i];
+        sad += (uint64_t)(d < 0 ? -d : d);
+      }
+      COUNT_READS(2 * w);
+      if ((double)sad > bound) {
+        break;
+      }
+    }
+    return (double)sad;
+  }
+
+  uint64_t prod = 0, sum1 = 0, sq1 = 0;
+  if (lv->sum != NULL) {
+    for (int j = 0; j < h; ++j) {
+      const uint8* row1 = RowAt(img1, x, y + j);
+      const uint8* row2 = Row(img2, j);
+      for (int i = 0; i < w; ++i) {
+        prod += (uint64_t)row1[i] * row2[i];
+      }
+      COUNT_READS(2 * w);
+    }
+    sum1 = windowSum(lv, lv->sum, x, y);
+    sq1 = windowSum(lv, lv->sq, x, y);
+  } else {
+    for (int j = 0; j < h; ++j) {
+      const uint8* row1 = RowAt(img1, x, y + j);
+      const uint8* row2 = Row(img2, j);
+      for (int i = 0; i < w; ++i) {
+        prod += (uint64_t)row1[i] * row2[i];
+        sum1 += row1[i];
+        sq1 += (uint64_t)row1[i] * row1[i];
+      }
+      COUNT_READS(2 * w);
+    }
+  }
+  // Sums of squared deviations and of products of deviations, times n.
+  const long double n = (long double)w * h;
+  const long double s1 = (long double)sum1;
+  const long double s2 = (long double)lv->sum2;
+  const long double var1 = n * sq1 - s1 * s1;
+  const long double var2 = n * lv->sq2 - s2 * s2;
+  if (var1 <= 0 || var2 <= 0) {
+    return var1 <= 0 && var2 <= 0 ? -1.0 : 0.0;
+  }
+  const double ncc = (double)((n * prod - s1 * s2) / sqrtl(var1 * var2));
+  return ncc > 1.0 ? -1.0 : (ncc < -1.0 ? 1.0 : -ncc);
+}
+
+// Cost above which a candidate cannot enter best.
+static double bestBound(const Best* best) {
+  return best->n < best->size ? INFINITY : best->c[best->n - 1].cost;
+}
+
+// Does candidate a come before candidate b?
+static int candidateBefore(const Candidate* a, const Candidate* b) {
+  if (a->cost != b->cost) return a->cost < b->cost;
+  if (a->y != b->y) return a->y < b->y;
+  return a->x < b->x;
+}
+
+// Add a candidate to best, if it is good enough (and not there yet).
+static void bestInsert(Best* best, double cost, int x, int y) {
+  const Candidate cand = { .cost = cost, .x = x, .y = y };
+  if (best->n == best->size && !candidateBefore(&cand, &best->c[best->n - 1])) {
+    return;
+  }
+  for (int k = 0; k < best->n; ++k) {
+    if (best->c[k].x == x && best->c[k].y == y) {
+      return;
+    }
+  }
+  int k = best->n < best->size ? best->n++ : best->n - 1;
+  while (k > 0 && candidateBefore(&cand, &best->c[k - 1])) {
+    best->c[k] = best->c[k - 1];
+    --k;
+  }
+  best->c[k] = cand;
+}
+
+// Scoring every position of a level, in bands.
+typedef struct {
+  const Level* lv;
+  ImageMatchMethod method;
+  Best* best;  // best candidates of each band
+} BestJob;
+
+static void bestBand(void* arg, int b, int y0, int y1) {
+  const BestJob* job = (const BestJob*)arg;
+  const Level* lv = job->lv;
+  Best* best = &job->best[b];
+  const int n = lv->img1->width - lv->img2->width + 1;
+  for (int y = y0; y < y1; ++y) {
+    for (int x = 0; x < n; ++x) {
+      const double cost = matchCost(lv, job->method, x, y, bestBound(best));
+      if (cost <= bestBound(best)) {
+        bestInsert(best, cost, x, y);
+      }
+    }
+  }
+}
+
+// Best candidates at level lv, scoring every position.
+static void searchLevel(const Level* lv, ImageMatchMethod method, Best* best) {
+  Best best1;
+  BestJob job = { .lv = lv, .method = method };
+  int nbands = numBands(lv->img1->height - lv->img2->height + 1);
+  job.best = nbands > 1 ? calloc((size_t)nbands, sizeof(Best)) : NULL;
+  if (job.best == NULL) {
+    nbands = 1;
+    job.best = &best1;
+  }
+  for (int b = 0; b < nbands; ++b) {
+    job.best[b].n = 0;
+    job.best[b].size = best->size;
+  }
+  ForBands(lv->img1->height - lv->img2->height + 1, nbands, bestBand, &job);
+
+  // The best candidates overall are among the best of each band.
+  for (int b = 0; b < nbands; ++b) {
+    for (int k = 0; k < job.best[b].n; ++k) {
+      bestInsert(best, job.best[b].c[k].cost, job.best[b].c[k].x, job.best[b].c[k].y);
+    }
+  }
+  if (job.best != &best1) {
+    free(job.best);
+  }
+}
+
+// Best candidates at level lv, scoring the positions around the candidates
+// of the level above (coarse).
+static void refineLevel(const Level* lv, ImageMatchMethod method,
+                        const Best* coarse, Best* best) {
+  const int xmax = lv->img1->width - lv->img2->width;
+  const int ymax = lv->img1->height - lv->img2->height;
+  for (int k = 0; k < coarse->n; ++k) {
+    const int cx = 2 * coarse->c[k].x;
+    const int cy = 2 * coarse->c[k].y;
+    for (int y = maxInt(cy - REFINE, 0); y <= minInt(cy + REFINE, ymax); ++y) {
+      for (int x = maxInt(cx - REFINE, 0); x <= minInt(cx + REFINE, xmax); ++x) {
+        const double cost = matchCost(lv, method, x, y, bestBound(best));
+        if (cost <= bestBound(best)) {
+          bestInsert(best, cost, x, y);
+        }
+      }
+    }
+  }
+}
+
+/// Locate the best approximate match of a subimage inside another image.
+/// Searches for img2 inside img1, scoring each position with the given
+/// method, and finds the position with the best score.
+/// Requires: img1, img2, px, py and pscore must not be NULL.
+/// Ensures: The images are not modified.
+/// 
+/// On success, returns 1, sets the position in (*px, *py) and its score in
+/// *pscore.
+/// On failure, returns 0 and errno/errCause are set.
+int ImageLocateBest(Image img1, Image img2, ImageMatchMethod method,
+                    int* px, int* py, double* pscore) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  assert (ImageValidRect(img1, 0, 0, img2->width, img2->height));
+  assert (method == IMAGE_MATCH_SAD || method == IMAGE_MATCH_NCC);
+  assert (px != NULL);
+  assert (py != NULL);
+  assert (pscore != NULL);
+
+  // Build the pyramid: levels[0] is full resolution.
+  Level levels[PYRAMID_LEVELS + 1] = { { .img1 = img1, .img2 = img2 } };
+  int nlevels = 1;
+  int ok = 1;
+  while (ok && nlevels <= PYRAMID_LEVELS &&
+         levels[nlevels - 1].img2->width / 2 >= PYRAMID_MIN &&
+         levels[nlevels - 1].img2->height / 2 >= PYRAMID_MIN) {
+    Level* lv = &levels[nlevels++];
+    lv->img1 = halve(levels[nlevels - 2].img1);
+    lv->img2 = halve(levels[nlevels - 2].img2);
+    ok = lv->img1 != NULL && lv->img2 != NULL;
+  }
+  for (int l = 0; l < nlevels && ok; ++l) {
+    ok = levelInit(&levels[l], l == nlevels - 1);
+  }
+
+  if (ok) {
+    // Score every position at the top level, then refine down.
+    Best best = { .size = nlevels > 1 ? NBEST : 1 };
+    searchLevel(&levels[nlevels - 1], method, &best);
+    for (int l = nlevels - 2; l >= 0; --l) {
+      Best finer = { .size = l > 0 ? NBEST : 1 };
+      refineLevel(&levels[l], method, &best, &finer);
+      best = finer;
+    }
+    *px = best.c[0].x;
+    *py = best.c[0].y;
+    *pscore = method == IMAGE_MATCH_SAD ? best.c[0].cost : -best.c[0].cost;
+  }
+
+  for (int l = 0; l < nlevels; ++l) {
+    if (l > 0) {
+      ImageDestroy(&levels[l].img1);
+      ImageDestroy(&levels[l].img2);
+    }
+    levelFree(&levels[l]);
+  }
+  return check(ok, "Cannot allocate memory for the search");
 }
 
 
 /// Filtering
 
+// Blur engine
+//
+// The mean filter is separable, so ImageBlur does not need to re-sum the
+// whole (2dx+1)x(2dy+1) window for every pixel.  Instead, it keeps a running
+// vertical sum for each column (colsum[x] holds the sum of column x over the
+// rows of the current window), and slides a horizontal window over those
+// column sums.  Moving down one row adds the row entering the window and
+// subtracts the row leaving it; moving right one pixel adds one column sum and
+// subtracts another.  So the cost per pixel does not depend on dx nor dy.
+//
+// The image is blurred in-place, row by row, so the original values of the
+// rows that still have to leave the window are kept in a small ring buffer
+// of (dy+1) rows.
+//
+// In parallel, each band of rows is blurred like that, but it also needs
+// the original values of the dy rows above and below it, which belong to
+// the neighbour bands.  So, before blurring, each band copies its rows that
+// are in the window [Y-dy, Y+dy) around each boundary Y between bands, and
+// then bands get their neighbours' rows from those copies.
+//
+// Rounding and edge-clamping are exactly those of the straightforward
+// algorithm: each mean is computed over the window clamped to the image,
+// as (double)sum / (double)count + 0.5, truncated.
+
+// Compute one blurred row from the column sums.
+//   colsum : vertical sums of the window rows, one per column.
+//   rows : number of rows summed in colsum.
+//   out : where to store the w blurred pixels.
+static void blurRow(const uint64_t* colsum, int w, int dx, int rows, uint8* out) {
+  uint64_t sum = 0;
+  // Window [x-dx, x+dx] for x = -1 (so the first step adds colsum[dx]).
+  for (int i = 0; i < dx && i < w; ++i) {
+    sum += colsum[i];
+  }
+  for (int x = 0; x < w; ++x) {
+    if (x + dx < w) {
+      sum += colsum[x + dx];
+    }
+    if (x - dx - 1 >= 0) {
+      sum -= colsum[x - dx - 1];
+    }
+    const int start_x = clampInt(x - dx, 0, w - 1);
+    const int end_x = clampInt(x + dx, 0, w - 1);
+    const double count = (double)(end_x - start_x + 1) * (double)rows;
+    out[x] = (uint8)((double)sum / count + 0.5);
+  }
+}
+
+typedef struct {
+  Image img;
+  int dx, dy;
+  int nbands;
+  uint8* edges;      // rows [Y-dy, Y+dy) around each boundary Y between bands
+  uint64_t* colsum;  // column sums, w per band
+  uint8* ring;       // ring buffers, (dy+1)*w per band
+} BlurJob;
+
+// Copy of row r around the boundary between bands k-1 and k.
+static uint8* edgeRow(const BlurJob* job, int k, int r) {
+  const int w = job->img->width;
+  const int top = bandStart(job->img->height, job->nbands, k) - job->dy;
+  return job->edges + ((size_t)(k - 1) * 2 * job->dy + (size_t)(r - top)) * w;
+}
+
+// Copy the rows of band b = [y0, y1) that its neighbours need.
+static void blurEdgesBand(void* arg, int b, int y0, int y1) {
+  const BlurJob* job = (const BlurJob*)arg;
+  const int w = job->img->width;
+  for (int y = y0; y < y1; ++y) {
+    if (b > 0 && y < y0 + job->dy) {
+      memcpy(edgeRow(job, b, y), Row(job->img, y), (size_t)w);
+      COUNT_READS(w);
+    }
+    if (b + 1 < job->nbands && y >= y1 - job->dy) {
+      memcpy(edgeRow(job, b + 1, y), Row(job->img, y), (size_t)w);
+      COUNT_READS(w);
+    }
+  }
+}
+
+// Original row r, for band b = [y0, y1), when rows [y0, y) were blurred.
+// Rows still to leave the window, in [y0, y), must be read from the ring.
+static const uint8* blurSource(const BlurJob* job, int b, int y0, int y1, int r) {
+  if (r < y0) {
+    return edgeRow(job, b, r);
+  }
+  if (r >= y1) {
+    return edgeRow(job, b + 1, r);
+  }
+  return Row(job->img, r);
+}
+
+// Blur rows [y0, y1) of band b.
+static void blurBand(void* arg, int b, int y0, int y1) {
+  const BlurJob* job = (const BlurJob*)arg;
+  const int w = job->img->width;
+  const int h = job->img->height;
+  const int dx = job->dx;
+  const int dy = job->dy;
+  uint64_t* colsum = job->colsum + (size_t)b * w;
+  uint8* ring = job->ring + (size_t)b * (dy + 1) * w;
+
+  // Start with the rows [y0-dy, y0+dy-1], the first step adds row y0+dy.
+  for (int j = clampInt(y0 - dy, 0, h); j < y0 + dy && j < h; ++j) {
+    const uint8* row = blurSource(job, b, y0, y1, j);
+    for (int x = 0; x < w; ++x) {
+      colsum[x] += row[x];
+    }
+    COUNT_READS(w);
+  }
+
+  for (int y = y0; y < y1; ++y) {
+    uint8* row = Row(job->img, y);
+    uint8* saved = ring + (size_t)(y % (dy + 1)) * w;
+
+    // Row y+dy enters the window (it has not been overwritten yet).
+    if (y + dy < h) {
+      const uint8* in = blurSource(job, b, y0, y1, y + dy);
+      for (int x = 0; x < w; ++x) {
+        colsum[x] += in[x];
+      }
+      COUNT_READS(w);
+    }
+    // Row y-dy-1 leaves the window.  If it is in this band, it was saved in
+    // the ring slot now reused.
+    if (y > y0 && y - dy - 1 >= 0) {
+      const uint8* out = y - dy - 1 >= y0 ? saved : blurSource(job, b, y0, y1, y - dy - 1);
+      for (int x = 0; x < w; ++x) {
+        colsum[x] -= out[x];
+      }
+    }
+    // Save the original row y before overwriting it.
+    for (int x = 0; x < w; ++x) {
+      saved[x] = row[x];
+    }
+    COUNT_READS(w);
+
+    const int start_y = clampInt(y - dy, 0, h - 1);
+    const int end_y = clampInt(y + dy, 0, h - 1);
+    blurRow(colsum, w, dx, end_y - start_y + 1, row);
+    COUNT_WRITES(w);
+  }
+}
+
 /// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
 /// Each pixel is substituted by the mean of the pixels in the rectangle
 /// Requires: img must not be NULL.
@@ -710,39 +2521,44 @@ void ImageBlur(Image img, int dx, int dy) { ///
   assert (dx >= 0);
   assert (dy >= 0);
 
-  Image blurred = ImageCreate(img->width, img->height, img->maxval);
-  if (check(blurred == NULL, "Cannot allocate memory for blurred image")) {
+  const int w = img->width;
+  const int h = img->height;
+  if (w == 0 || h == 0) {
+    return;
+  }
+  // Windows are clamped to the image, so larger radii make no difference.
+  dx = minInt(dx, w - 1);
+  dy = minInt(dy, h - 1);
+
+  // Bands must have at least dy rows, so that the rows a band needs from
+  // its neighbours all belong to the adjacent bands.
+  BlurJob job = { .img = img, .dx = dx, .dy = dy };
+  job.nbands = dy > 0 ? minInt(numBands(h), h / dy) : numBands(h);
+  const size_t nedges = (size_t)(job.nbands - 1) * 2 * dy * w;
+  const size_t ncolsum = (size_t)job.nbands * w * sizeof(uint64_t);
+  const size_t nring = (size_t)job.nbands * (dy + 1) * w;
+  job.colsum = (uint64_t*)bufferAlloc(ncolsum, 1);
+  job.ring = (uint8*)bufferAlloc(nring, 0);
+  job.edges = (uint8*)bufferAlloc(nedges, 0);
+  if (!check(job.colsum != NULL && job.ring != NULL && job.edges != NULL,
+             "Cannot allocate memory for blur buffers")) {
+    bufferFree(job.colsum, ncolsum);
+    bufferFree(job.ring, nring);
+    bufferFree(job.edges, nedges);
     return;
   }
 
-  for (int y = 0; y < img->height; ++y) {
-    for (int x = 0; x < img->width; ++x) {
-      int sum = 0;
-
-      const int start_x = clampInt(x - dx, 0, img->width - 1);
-      const int end_x = clampInt(x + dx, 0, img->width - 1);
-      const int start_y = clampInt(y - dy, 0, img->height - 1);
-      const int end_y = clampInt(y + dy, 0, img->height - 1);
-
-      for (int j = start_y; j <= end_y; ++j) {
-        for (int i = start_x; i <= end_x; ++i) {
-          sum += ImageGetPixel(
-            img,
-            i,
-            j
-          );
-        }
-      }
-
-      ImageSetPixel(blurred,
-        x,
-        y,
-        (uint8)((double) sum / (double) ((end_x - start_x + 1) * (end_y - start_y + 1)) + 0.5)
-      );
-    }
+  if (job.nbands > 1) {
+    InstrTraceBegin("blur edges", NULL);
+    ForBands(h, job.nbands, blurEdgesBand, &job);
+    InstrTraceEnd();
   }
+  InstrTraceBegin("blur rows", NULL);
+  ForBands(h, job.nbands, blurBand, &job);
+  InstrTraceEnd();
 
-  ImagePaste(img, 0, 0, blurred);
-  ImageDestroy(&blurred);
+  bufferFree(job.edges, nedges);
+  bufferFree(job.ring, nring);
+  bufferFree(job.colsum, ncolsum);
 }
 
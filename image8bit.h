@@ -33,12 +33,23 @@ typedef struct image *Image;
 ///
 /// After a successful operation, the result is not garanteed (it might be
 /// the previous error cause).  It is not meant to be used in that situation!
+/// Like errno, the error cause is kept per thread: this function must be
+/// called in the thread where the failure happened.
 char* ImageErrMsg() ;
 
 /// Init Image library.  (Call once!)
-/// Currently, simply calibrate instrumentation and set names of counters.
+/// Set names of instrumentation counters, and prepare the library.
+/// (Instrumentation is calibrated later, only if times are printed.)
 void ImageInit(void) ;
 
+/// Set the number of threads used by image operations.
+/// Some operations (ImageBlur, ImageBlend, ImageRotate, the ImageLocate...
+/// searches and point operations based on ImageApplyLUT, such as ImageBrighten)
+/// split the image in bands of rows and process them in parallel.
+/// The results are identical to those with a single thread (the default).
+/// Must not be called while other image operations are running.
+void ImageSetThreads(int n) ;
+
 /// Image management functions
 
 /// Create a new black image.
@@ -67,12 +78,73 @@ void ImageDestroy(Image* imgp) ;
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageLoad(const char* filename) ;
 
+/// Load a raw PGM file, mapping it into memory.
+/// Same as ImageLoad, but the pixels are not read nor copied: the image
+/// uses them directly in a private (copy-on-write) mapping of the file.
+/// So loading takes (almost) constant time, even for huge files, and pixels
+/// are only read from the file when they are accessed.
+/// Changes to the image are never written back to the file.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageLoadMapped(const char* filename) ;
+
 /// Save image to PGM file.
 /// On success, returns nonzero.
 /// On failure, returns 0, errno/errCause are set appropriately, and
 /// a partial and invalid file may be left in the system.
 int ImageSave(Image img, const char* filename) ;
 
+/// Streaming PGM file operations
+
+/// These functions read and write raw PGM files by bands of rows, so that
+/// images much larger than the available memory may be processed one band
+/// at a time: read some rows into a (small) image, process it, and write
+/// it out.
+
+typedef struct imageStream *ImageStream;
+
+/// Open a raw PGM file for reading by bands of rows.
+/// On success, returns a new stream.
+/// (The caller is responsible for closing it!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageStream ImageStreamOpen(const char* filename) ;
+
+/// Create a raw PGM file for writing by bands of rows, with the given
+/// image dimensions and maximum gray level.
+/// On success, returns a new stream.
+/// (The caller is responsible for closing it!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageStream ImageStreamCreate(const char* filename, int width, int height, uint8 maxval) ;
+
+/// Close a stream, and set (*sp) to NULL.
+/// If a stream open for writing was not written completely, the file is
+/// left invalid.
+/// On success, returns nonzero, and errno/errCause are preserved (so this
+/// may be used to clean up after other failures).
+/// On failure (when writing), returns 0 and errno/errCause are set.
+int ImageStreamClose(ImageStream* sp) ;
+
+/// Get the dimensions and the maximum gray level of the image in a stream.
+int ImageStreamWidth(ImageStream s) ;
+int ImageStreamHeight(ImageStream s) ;
+int ImageStreamMaxval(ImageStream s) ;
+
+/// Read rows [y, y+h) of the image in stream s into img, where h is the
+/// height of img (which may be a view of a larger image).
+/// Requires: s must be open for reading, img must have the same width,
+/// and the rows must be inside the image in s.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set.
+int ImageStreamRead(ImageStream s, int y, Image img) ;
+
+/// Write rows [y0, y1) of img to stream s, after the rows written before.
+/// Requires: s must be open for writing, img must have the same width,
+/// and the rows must fit in the rest of the image in s.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set.
+int ImageStreamWrite(ImageStream s, Image img, int y0, int y1) ;
+
 /// Information queries
 
 /// These functions do not modify the image and never fail.
@@ -119,6 +191,11 @@ void ImageSetPixel(Image img, int x, int y, uint8 level) ;
 /// All of these functions modify the image in-place: no allocation involved.
 /// They never fail.
 
+/// Apply a lookup table to image.
+/// Each pixel with level v is set to lut[v].
+/// Requires: lut entries must not exceed the image maxval.
+void ImageApplyLUT(Image img, const uint8 lut[256]) ;
+
 /// Transform image to negative image.
 /// This transforms dark pixels to light pixels and vice-versa,
 /// resulting in a "photographic negative" effect.
@@ -135,6 +212,29 @@ void ImageThreshold(Image img, uint8 thr) ;
 /// darken the image if factor<1.0.
 void ImageBrighten(Image img, double factor) ;
 
+/// Apply gamma correction to image.
+/// Set each level v to maxval * (v/maxval)^gamma, saturating at maxval.
+/// This will brighten the midtones if gamma<1.0 and
+/// darken them if gamma>1.0.
+/// Requires: gamma > 0.0.
+void ImageGamma(Image img, double gamma) ;
+
+/// Adjust the levels of image.
+/// Linearly map levels in [black, white] to [0, maxval],
+/// saturating levels outside that interval.
+/// Requires: black < white.
+void ImageLevels(Image img, uint8 black, uint8 white) ;
+
+/// Stretch the contrast of image.
+/// Linearly map the range of levels in the image to [0, maxval].
+/// If the image has a single level, it is not modified.
+void ImageContrastStretch(Image img) ;
+
+/// Fill the rectangle (x,y,w,h) of image with the given level.
+/// Requires: The rectangle must be inside the image.
+///           level must not exceed the image maxval.
+void ImageFill(Image img, int x, int y, int w, int h, uint8 level) ;
+
 /// Geometric transformations
 
 /// These functions apply geometric transformations to an image,
@@ -155,6 +255,24 @@ void ImageBrighten(Image img, double factor) ;
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageRotate(Image img) ;
 
+/// Rotate an image clockwise.
+/// Returns a version of the image rotated 90 degrees clockwise.
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRotateCW(Image img) ;
+
+/// Rotate an image by 180 degrees.
+/// Returns a version of the image turned upside down.
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRotate180(Image img) ;
+
 /// Mirror an image = flip left-right.
 /// Returns a mirrored version of the image.
 /// Ensures: The original img is not modified.
@@ -164,6 +282,31 @@ Image ImageRotate(Image img) ;
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageMirror(Image img) ;
 
+/// Flip an image top-bottom.
+/// Returns a vertically flipped version of the image.
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageFlipVertical(Image img) ;
+
+/// Transform an image: reorient it and map its levels, in a single pass.
+/// Returns an image where pixel (u, v) has level lut[L] (or L, if lut is
+/// NULL), where L is the level of pixel (a, b) of img, or (b, a) if
+/// transpose is nonzero, with
+///   a = flipx ? W'-1-u : u  and  b = flipy ? H'-1-v : v,
+/// and W'xH' the dimensions of the result.
+/// Any chain of rotations, flips and ImageApplyLUT calls may be composed
+/// into one ImageTransform, which reads and writes each pixel only once.
+/// Requires: lut entries must not exceed the image maxval.
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageTransform(Image img, int transpose, int flipx, int flipy, const uint8 lut[256]) ;
+
 /// Crop a rectangular subimage from img.
 /// The rectangle is specified by the top left corner coords (x, y) and
 /// width w and height h.
@@ -178,6 +321,39 @@ Image ImageMirror(Image img) ;
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageCrop(Image img, int x, int y, int w, int h) ;
 
+/// Views
+
+/// A view is an image that shares the pixels of a rectangular region of
+/// another image: no pixels are copied to create it, and changes to its
+/// pixels are seen in the other image (and vice-versa).
+/// Views may be used wherever an image is accepted.
+/// Destroy views with ImageDestroy, as any other image; the shared pixels
+/// are freed only when all images using them are destroyed.
+/// Operations on two images require that the images do not overlap
+/// (a view and the image it views, for instance) where they write.
+
+/// Create a view of a rectangular subimage of img.
+/// The rectangle is specified by the top left corner coords (x, y) and
+/// width w and height h.
+/// Requires:
+///   The rectangle must be inside the original image.
+/// Ensures:
+///   The returned image has width w and height h, and shares its pixels
+///   with img.
+/// This takes constant time.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageCropView(Image img, int x, int y, int w, int h) ;
+
+/// Give img a compact copy of its pixels.
+/// If img shares its pixels with other images (views), they are copied to
+/// a new pixel array, owned by img alone.  Otherwise, nothing is done.
+/// On success, returns nonzero.
+/// On failure, returns 0, img is not modified, and errno/errCause are set.
+int ImageMaterialize(Image img) ;
+
 /// Operations on two images
 
 /// Paste an image into a larger image.
@@ -205,6 +381,43 @@ int ImageMatchSubImage(Image img1, int x, int y, Image img2) ;
 /// If no match is found, returns 0 and (*px, *py) are left untouched.
 int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) ;
 
+/// Function called by ImageLocateAll for each match at position (x, y).
+///   arg : the argument given to ImageLocateAll.
+typedef void (*ImageMatchFn)(int x, int y, void* arg);
+
+/// Locate all occurrences of a subimage inside another image.
+/// Searches for img2 inside img1, in a single scan, and calls
+/// found(x, y, arg) for each matching position (x, y), in raster order,
+/// one call at a time (but maybe from a worker thread, see ImageSetThreads).
+///   max : maximum number of matches to report (0 or less means no limit).
+/// Requires: img2 must fit inside img1.
+/// Returns the number of matches reported, or -1 if memory could not be
+/// allocated, or there are more than INT_MAX matches (errno/errCause are set).
+int ImageLocateAll(Image img1, Image img2, ImageMatchFn found, void* arg, int max) ;
+
+/// Ways to score how well a subimage matches a position (see ImageLocateBest).
+typedef enum {
+  IMAGE_MATCH_SAD,  // Sum of absolute differences: lower is better, 0 is exact.
+  IMAGE_MATCH_NCC,  // Normalized cross-correlation: higher is better, in [-1, 1].
+} ImageMatchMethod;
+
+/// Locate the best approximate match of a subimage inside another image.
+/// Searches for img2 inside img1, scoring each position with the given
+/// method, and finds the position with the best score.  Ties are broken in
+/// raster order.
+/// NCC is insensitive to brightness and contrast changes; a flat window
+/// matching a flat subimage has NCC 1, and a flat one matching a non-flat
+/// one has NCC 0.
+/// For large subimages, the search is coarse-to-fine (on downsampled
+/// images), so it might not find the best position if it does not stand
+/// out at low resolution.
+/// Requires: img2 must fit inside img1.
+/// On success, returns 1, sets the position in (*px, *py) and its score in
+/// *pscore.
+/// On failure, returns 0 and errno/errCause are set.
+int ImageLocateBest(Image img1, Image img2, ImageMatchMethod method,
+                    int* px, int* py, double* pscore) ;
+
 /// Filtering
 
 /// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
@@ -0,0 +1,179 @@
+/// image8bitPool - A pool of pixel buffers for the image8bit module.
+///
+/// See image8bitPool.h.
+///
+/// Free buffers are kept in one LIFO list per size class, linked through
+/// their first bytes, so the most recently freed (and probably cached)
+/// buffer is reused first.  Buffers of MAP_MIN bytes or more are mapped
+/// directly (mmap), so they come zeroed from the system and are returned
+/// to it at once when the pool is full; smaller ones come from
+/// posix_memalign.
+
+#include "image8bitPool.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define ALIGN 64               // alignment of all buffers
+#define MIN_CLASS 64           // size of the smallest class
+#define MAP_MIN (1 << 20)      // buffers of at least this size are mapped
+#define NCLASSES (4 * 64)      // four classes per power of two
+
+// A free buffer: the link to the next one is stored in the buffer itself.
+typedef struct Free {
+  struct Free* next;
+} Free;
+
+// Protects all the pool state below.
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static Free* lists[NCLASSES];          // free buffers of each class
+static size_t retained = 0;            // bytes in free buffers
+static size_t limit = (size_t)256 << 20;  // maximum bytes retained
+static int hugepages = 0;              // back mapped buffers by huge pages?
+
+// Size class of a buffer of size bytes.
+// Returns the index of the class, and sets *csize to its size.
+static int sizeClass(size_t size, size_t* csize) {
+  if (size <= MIN_CLASS) {
+    *csize = MIN_CLASS;
+    return 0;
+  }
+  // 2^e < size <= 2^(e+1), split in four classes of 2^(e-2) bytes
+  int e = 6;
+  while (e < 63 && ((size_t)1 << (e + 1)) < size) {
+    e++;
+  }
+  const size_t base = (size_t)1 << e;
+  const size_t step = base / 4;
+  const size_t k = (size - base + step - 1) / step;  // 1 to 4
+  *csize = base + k * step;
+  return (e - 6) * 4 + (int)k;
+}
+
+// Get a new buffer of a class of csize bytes from the system.
+static void* sysAlloc(size_t csize, int huge) {
+  if (csize >= MAP_MIN) {
+    void* p = mmap(NULL, csize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+      return NULL;
+    }
+#ifdef MADV_HUGEPAGE
+    if (huge) {
+      madvise(p, csize, MADV_HUGEPAGE);  // just a hint: ignore failures
+    }
+#endif
+    return p;
+  }
+  void* p = NULL;
+  const int err = posix_memalign(&p, ALIGN, csize);
+  if (err != 0) {
+    errno = err;
+    return NULL;
+  }
+  return p;
+}
+
+// Return a buffer of a class of csize bytes to the system.
+static void sysFree(void* p, size_t csize) {
+  if (csize >= MAP_MIN) {
+    munmap(p, csize);
+  } else {
+    free(p);
+  }
+}
+
+// Size of the buffers of class c (the inverse of sizeClass).
+static size_t classSize(int c) {
+  if (c == 0) {
+    return MIN_CLASS;
+  }
+  const int e = 6 + (c - 1) / 4;
+  return ((size_t)1 << e) + (size_t)((c - 1) % 4 + 1) * ((size_t)1 << (e - 2));
+}
+
+// Release retained buffers, largest first, until at most max bytes remain.
+// Called with lock held.
+static void release(size_t max) {
+  for (int c = NCLASSES - 1; c >= 0 && retained > max; c--) {
+    const size_t csize = classSize(c);
+    while (lists[c] != NULL && retained > max) {
+      Free* p = lists[c];
+      lists[c] = p->next;
+      retained -= csize;
+      sysFree(p, csize);
+    }
+  }
+}
+
+/// Set the maximum number of bytes retained, and the use of huge pages.
+void PoolConfigure(size_t max, int huge) { ///
+  pthread_mutex_lock(&lock);
+  limit = max;
+  hugepages = huge;
+  release(limit);
+  pthread_mutex_unlock(&lock);
+}
+
+/// Get a buffer of (at least) size bytes, aligned to 64 bytes.
+void* PoolAlloc(size_t size, int zero, int* hit) { ///
+  size_t csize;
+  const int c = sizeClass(size, &csize);
+
+  pthread_mutex_lock(&lock);
+  Free* p = lists[c];
+  if (p != NULL) {
+    lists[c] = p->next;
+    retained -= csize;
+  }
+  const int huge = hugepages;
+  pthread_mutex_unlock(&lock);
+
+  *hit = p != NULL;
+  if (p == NULL) {
+    void* q = sysAlloc(csize, huge);
+    // Mapped buffers are already zeroed by the system.
+    if (q != NULL && zero && csize < MAP_MIN) {
+      memset(q, 0, size);
+    }
+    return q;
+  }
+  if (zero) {
+    memset(p, 0, size);
+  }
+  return p;
+}
+
+/// Return buffer p, of the given size, to the pool.
+void PoolFree(void* p, size_t size) { ///
+  if (p == NULL) {
+    return;
+  }
+  size_t csize;
+  const int c = sizeClass(size, &csize);
+
+  pthread_mutex_lock(&lock);
+  if (retained + csize <= limit) {
+    Free* f = (Free*)p;
+    f->next = lists[c];
+    lists[c] = f;
+    retained += csize;
+    p = NULL;
+  }
+  pthread_mutex_unlock(&lock);
+
+  if (p != NULL) {
+    sysFree(p, csize);
+  }
+}
+
+/// Get the number of bytes retained in free buffers.
+size_t PoolRetained(void) { ///
+  pthread_mutex_lock(&lock);
+  const size_t n = retained;
+  pthread_mutex_unlock(&lock);
+  return n;
+}
@@ -0,0 +1,44 @@
+/// image8bitPool - A pool of pixel buffers for the image8bit module.
+///
+/// This is an internal module of image8bit: clients should not need it.
+///
+/// Image operations that create images (rotations, crops, ...) or need
+/// large temporary buffers (blur) allocate and free big arrays at a high
+/// rate.  Getting them from the system every time costs page faults (each
+/// new page must be mapped and zeroed) and fragments the heap.  Instead,
+/// freed buffers are kept in the pool, in free lists by size class, and
+/// reused by later requests of the same class.
+///
+/// Size classes grow geometrically, four per power of two, so a buffer is
+/// at most 25% larger than requested.  All buffers are aligned to 64 bytes
+/// (a cache line).  Large buffers are mapped directly from the system, and
+/// may be backed by huge pages.
+///
+/// All functions may be called concurrently from several threads.
+
+#ifndef IMAGE8BITPOOL_H
+#define IMAGE8BITPOOL_H
+
+#include <stddef.h>
+
+/// Set the maximum number of bytes the pool may retain in free buffers
+/// (0 disables reuse: freed buffers are always returned to the system),
+/// and whether large buffers should be backed by huge pages, if the system
+/// supports it.
+/// Buffers already retained beyond the new limit are released.
+void PoolConfigure(size_t limit, int hugepages) ;
+
+/// Get a buffer of (at least) size bytes, aligned to 64 bytes.
+///   zero : if nonzero, the first size bytes are set to zero.
+///   hit : set to 1 if the buffer was reused from the pool, 0 otherwise.
+/// Returns NULL if there is not enough memory (errno is set).
+void* PoolAlloc(size_t size, int zero, int* hit) ;
+
+/// Return buffer p, of the given size (as passed to PoolAlloc), to the pool.
+/// If p is NULL, nothing is done.
+void PoolFree(void* p, size_t size) ;
+
+/// Get the number of bytes retained in free buffers.
+size_t PoolRetained(void) ;
+
+#endif
@@ -0,0 +1,287 @@
+/// image8bitSimd - Row kernels for the image8bit module.
+///
+/// See image8bitSimd.h.
+///
+/// The vectorized kernels must produce exactly the same results as the
+/// scalar ones.  In particular, the blend kernels do their arithmetic in
+/// double precision, with the same operations in the same order as the
+/// scalar code, so even the +0.5 rounding gives identical levels.
+
+#include "image8bitSimd.h"
+
+#include <stdint.h>
+#include <string.h>
+
+/// Scalar kernels
+
+static void negativeScalar(uint8* p, size_t n, uint8 maxval) {
+  for (size_t i = 0; i < n; ++i) {
+    p[i] = (uint8)(maxval - p[i]);
+  }
+}
+
+static void thresholdScalar(uint8* p, size_t n, uint8 thr, uint8 maxval) {
+  for (size_t i = 0; i < n; ++i) {
+    p[i] = p[i] < thr ? 0 : maxval;
+  }
+}
+
+// Saturate x to [0, maxval] (for finite x), as clampDouble in image8bit.c.
+static inline double clampLevel(double x, double maxval) {
+  if (x > maxval) {
+    return maxval;
+  }
+  if (x < 0.0) {
+    return 0.0;
+  }
+  return x;
+}
+
+static void blendScalar(uint8* dst, const uint8* src, size_t n, double alpha, uint8 maxval) {
+  const double beta = 1 - alpha;
+  for (size_t i = 0; i < n; ++i) {
+    const double blended = beta * (double)dst[i] + alpha * (double)src[i];
+    dst[i] = (uint8)clampLevel(blended + 0.5, (double)maxval);
+  }
+}
+
+static void minmaxScalar(const uint8* p, size_t n, uint8* min, uint8* max) {
+  uint8 lo = *min;
+  uint8 hi = *max;
+  for (size_t i = 0; i < n; ++i) {
+    lo = p[i] < lo ? p[i] : lo;
+    hi = p[i] > hi ? p[i] : hi;
+  }
+  *min = lo;
+  *max = hi;
+}
+
+const PixKernels PixKernelsScalar = {
+  .name = "scalar",
+  .negative = negativeScalar,
+  .threshold = thresholdScalar,
+  .blend = blendScalar,
+  .minmax = minmaxScalar,
+};
+
+
+#if defined(__x86_64__) && defined(__GNUC__)
+
+#include <immintrin.h>
+
+/// SSE2 kernels (SSE2 is always available on x86-64)
+
+static void negativeSSE2(uint8* p, size_t n, uint8 maxval) {
+  const __m128i m = _mm_set1_epi8((char)maxval);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+    _mm_storeu_si128((__m128i*)(p + i), _mm_sub_epi8(m, v));
+  }
+  negativeScalar(p + i, n - i, maxval);
+}
+
+static void thresholdSSE2(uint8* p, size_t n, uint8 thr, uint8 maxval) {
+  const __m128i t = _mm_set1_epi8((char)thr);
+  const __m128i m = _mm_set1_epi8((char)maxval);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+    // v >= thr (unsigned) <=> max(v, thr) == v
+    __m128i ge = _mm_cmpeq_epi8(_mm_max_epu8(v, t), v);
+    _mm_storeu_si128((__m128i*)(p + i), _mm_and_si128(ge, m));
+  }
+  thresholdScalar(p + i, n - i, thr, maxval);
+}
+
+// Blend 2 pixels held as doubles in d and s.
+static inline __m128d blend2SSE2(__m128d d, __m128d s, __m128d alpha, __m128d beta,
+                                 __m128d half, __m128d zero, __m128d maxv) {
+  __m128d r = _mm_add_pd(_mm_mul_pd(beta, d), _mm_mul_pd(alpha, s));
+  r = _mm_add_pd(r, half);
+  return _mm_min_pd(_mm_max_pd(r, zero), maxv);
+}
+
+static void blendSSE2(uint8* dst, const uint8* src, size_t n, double alpha, uint8 maxval) {
+  const __m128i z = _mm_setzero_si128();
+  const __m128d va = _mm_set1_pd(alpha);
+  const __m128d vb = _mm_set1_pd(1 - alpha);
+  const __m128d half = _mm_set1_pd(0.5);
+  const __m128d zero = _mm_setzero_pd();
+  const __m128d maxv = _mm_set1_pd((double)maxval);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    int32_t d4, s4;
+    memcpy(&d4, dst + i, 4);
+    memcpy(&s4, src + i, 4);
+    // Widen 4 bytes to 4 int32, then to 2+2 doubles.
+    __m128i d = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(d4), z), z);
+    __m128i s = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(s4), z), z);
+    __m128d dlo = _mm_cvtepi32_pd(d);
+    __m128d dhi = _mm_cvtepi32_pd(_mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2)));
+    __m128d slo = _mm_cvtepi32_pd(s);
+    __m128d shi = _mm_cvtepi32_pd(_mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+    __m128i rlo = _mm_cvttpd_epi32(blend2SSE2(dlo, slo, va, vb, half, zero, maxv));
+    __m128i rhi = _mm_cvttpd_epi32(blend2SSE2(dhi, shi, va, vb, half, zero, maxv));
+    __m128i r = _mm_unpacklo_epi64(rlo, rhi);
+    r = _mm_packs_epi32(r, r);
+    r = _mm_packus_epi16(r, r);
+    d4 = _mm_cvtsi128_si32(r);
+    memcpy(dst + i, &d4, 4);
+  }
+  blendScalar(dst + i, src + i, n - i, alpha, maxval);
+}
+
+// Lower *min and raise *max with the 16 levels in vectors lo and hi.
+static void reduceMinmax(__m128i lo, __m128i hi, uint8* min, uint8* max) {
+  uint8 l[16], h[16];
+  _mm_storeu_si128((__m128i*)l, lo);
+  _mm_storeu_si128((__m128i*)h, hi);
+  minmaxScalar(l, 16, min, max);
+  minmaxScalar(h, 16, min, max);
+}
+
+static void minmaxSSE2(const uint8* p, size_t n, uint8* min, uint8* max) {
+  size_t i = 0;
+  if (n >= 16) {
+    __m128i lo = _mm_set1_epi8((char)*min);
+    __m128i hi = _mm_set1_epi8((char)*max);
+    for (; i + 16 <= n; i += 16) {
+      __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+      lo = _mm_min_epu8(lo, v);
+      hi = _mm_max_epu8(hi, v);
+    }
+    reduceMinmax(lo, hi, min, max);
+  }
+  minmaxScalar(p + i, n - i, min, max);
+}
+
+static const PixKernels PixKernelsSSE2 = {
+  .name = "sse2",
+  .negative = negativeSSE2,
+  .threshold = thresholdSSE2,
+  .blend = blendSSE2,
+  .minmax = minmaxSSE2,
+};
+
+/// AVX2 kernels (compiled for AVX2, used only if the CPU supports it)
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static void negativeAVX2(uint8* p, size_t n, uint8 maxval) {
+  const __m256i m = _mm256_set1_epi8((char)maxval);
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i*)(p + i));
+    _mm256_storeu_si256((__m256i*)(p + i), _mm256_sub_epi8(m, v));
+  }
+  negativeScalar(p + i, n - i, maxval);
+}
+
+AVX2 static void thresholdAVX2(uint8* p, size_t n, uint8 thr, uint8 maxval) {
+  const __m256i t = _mm256_set1_epi8((char)thr);
+  const __m256i m = _mm256_set1_epi8((char)maxval);
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i*)(p + i));
+    __m256i ge = _mm256_cmpeq_epi8(_mm256_max_epu8(v, t), v);
+    _mm256_storeu_si256((__m256i*)(p + i), _mm256_and_si256(ge, m));
+  }
+  thresholdScalar(p + i, n - i, thr, maxval);
+}
+
+AVX2 static inline __m256d blend4AVX2(__m256d d, __m256d s, __m256d alpha, __m256d beta,
+                                      __m256d half, __m256d zero, __m256d maxv) {
+  __m256d r = _mm256_add_pd(_mm256_mul_pd(beta, d), _mm256_mul_pd(alpha, s));
+  r = _mm256_add_pd(r, half);
+  return _mm256_min_pd(_mm256_max_pd(r, zero), maxv);
+}
+
+AVX2 static void blendAVX2(uint8* dst, const uint8* src, size_t n, double alpha, uint8 maxval) {
+  const __m256d va = _mm256_set1_pd(alpha);
+  const __m256d vb = _mm256_set1_pd(1 - alpha);
+  const __m256d half = _mm256_set1_pd(0.5);
+  const __m256d zero = _mm256_setzero_pd();
+  const __m256d maxv = _mm256_set1_pd((double)maxval);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    // Widen 8 bytes to 8 int32, then to 4+4 doubles.
+    __m256i d = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(dst + i)));
+    __m256i s = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(src + i)));
+    __m256d dlo = _mm256_cvtepi32_pd(_mm256_castsi256_si128(d));
+    __m256d dhi = _mm256_cvtepi32_pd(_mm256_extracti128_si256(d, 1));
+    __m256d slo = _mm256_cvtepi32_pd(_mm256_castsi256_si128(s));
+    __m256d shi = _mm256_cvtepi32_pd(_mm256_extracti128_si256(s, 1));
+    __m128i rlo = _mm256_cvttpd_epi32(blend4AVX2(dlo, slo, va, vb, half, zero, maxv));
+    __m128i rhi = _mm256_cvttpd_epi32(blend4AVX2(dhi, shi, va, vb, half, zero, maxv));
+    __m128i r = _mm_packs_epi32(rlo, rhi);
+    r = _mm_packus_epi16(r, r);
+    _mm_storel_epi64((__m128i*)(dst + i), r);
+  }
+  blendScalar(dst + i, src + i, n - i, alpha, maxval);
+}
+
+AVX2 static void minmaxAVX2(const uint8* p, size_t n, uint8* min, uint8* max) {
+  size_t i = 0;
+  if (n >= 32) {
+    __m256i lo = _mm256_set1_epi8((char)*min);
+    __m256i hi = _mm256_set1_epi8((char)*max);
+    for (; i + 32 <= n; i += 32) {
+      __m256i v = _mm256_loadu_si256((const __m256i*)(p + i));
+      lo = _mm256_min_epu8(lo, v);
+      hi = _mm256_max_epu8(hi, v);
+    }
+    __m128i lo16 = _mm_min_epu8(_mm256_castsi256_si128(lo), _mm256_extracti128_si256(lo, 1));
+    __m128i hi16 = _mm_max_epu8(_mm256_castsi256_si128(hi), _mm256_extracti128_si256(hi, 1));
+    reduceMinmax(lo16, hi16, min, max);
+  }
+  minmaxScalar(p + i, n - i, min, max);
+}
+
+static const PixKernels PixKernelsAVX2 = {
+  .name = "avx2",
+  .negative = negativeAVX2,
+  .threshold = thresholdAVX2,
+  .blend = blendAVX2,
+  .minmax = minmaxAVX2,
+};
+
+// Kernel tables, from best to worst, and whether the CPU supports them.
+static const PixKernels* kernelTables[] = {
+  &PixKernelsAVX2, &PixKernelsSSE2, &PixKernelsScalar,
+};
+
+static int supported(const PixKernels* k) {
+  __builtin_cpu_init();
+  if (k == &PixKernelsAVX2) {
+    return __builtin_cpu_supports("avx2");
+  }
+  return 1;
+}
+
+#else
+
+static const PixKernels* kernelTables[] = {
+  &PixKernelsScalar,
+};
+
+static int supported(const PixKernels* k) {
+  return 1;
+}
+
+#endif
+
+/// Get a table of kernels supported by the running CPU.
+///   name : the instruction set wanted ("scalar", "sse2", "avx2"),
+///          or NULL for the best one available.
+/// Returns NULL if the requested instruction set is not available.
+const PixKernels* PixKernelsSelect(const char* name) { ///
+  const size_t ntables = sizeof(kernelTables) / sizeof(kernelTables[0]);
+  for (size_t t = 0; t < ntables; ++t) {
+    const PixKernels* k = kernelTables[t];
+    if ((name == NULL || strcmp(name, k->name) == 0) && supported(k)) {
+      return k;
+    }
+  }
+  return NULL;
+}
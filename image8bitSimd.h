@@ -0,0 +1,48 @@
+/// image8bitSimd - Row kernels for the image8bit module.
+///
+/// This is an internal module of image8bit: clients should not need it.
+///
+/// It provides the innermost loops of some image8bit operations, as
+/// functions that process n contiguous pixels (a row, or part of it).
+/// There is a portable scalar implementation of every kernel, and, on
+/// x86-64, vectorized implementations using SSE2 and AVX2 instructions.
+/// All implementations produce exactly the same results.
+///
+/// The kernels are grouped in tables (PixKernels), one per instruction set.
+/// Use PixKernelsSelect to get the best table supported by the running CPU.
+
+#ifndef IMAGE8BITSIMD_H
+#define IMAGE8BITSIMD_H
+
+#include <stddef.h>
+#include "image8bit.h"
+
+/// A table of row kernels.
+typedef struct {
+  /// Name of the instruction set used ("scalar", "sse2", "avx2").
+  const char* name;
+
+  /// Set each p[i] to maxval - p[i].
+  void (*negative)(uint8* p, size_t n, uint8 maxval);
+
+  /// Set each p[i] to 0 if p[i] < thr, or to maxval otherwise.
+  void (*threshold)(uint8* p, size_t n, uint8 thr, uint8 maxval);
+
+  /// Set each dst[i] to (1-alpha)*dst[i] + alpha*src[i], computed in double,
+  /// rounded by adding 0.5 and truncating, and saturated to [0, maxval].
+  void (*blend)(uint8* dst, const uint8* src, size_t n, double alpha, uint8 maxval);
+
+  /// Lower *min and raise *max to include the levels of p[0..n-1].
+  void (*minmax)(const uint8* p, size_t n, uint8* min, uint8* max);
+} PixKernels;
+
+/// The portable scalar kernels (always available).
+extern const PixKernels PixKernelsScalar;
+
+/// Get a table of kernels supported by the running CPU.
+///   name : the instruction set wanted ("scalar", "sse2", "avx2"),
+///          or NULL for the best one available.
+/// Returns NULL if the requested instruction set is not available.
+const PixKernels* PixKernelsSelect(const char* name) ;
+
+#endif
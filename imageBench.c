@@ -0,0 +1,490 @@
+// imageBench - Benchmark the functions of the image8bit module.
+//
+// For each image size and content type, this program generates a synthetic
+// image, then times every public image8bit function on it: one warmup run,
+// followed by REPS timed runs.  Functions that modify their image run on a
+// fresh copy of it each time (the copy is not timed).  Results are printed
+// as CSV, one line per function, size and content: best and mean times,
+// throughput (MP/s) and time per pixel (ns/pixel), both relative to the
+// pixels of the image and based on the best time, and the instrumentation
+// counters of the last run.
+//
+// Compare the CSV of different builds (make vs make release, for instance)
+// or versions to catch performance regressions.
+//
+// You may freely use and modify this code, NO WARRANTY, blah blah,
+// as long as you give proper credit to the original and subsequent authors.
+
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "error.h"
+#include "image8bit.h"
+#include "instrumentation.h"
+
+static const char* USAGE =
+    "USAGE: imageBench [-j N] [-r REPS] [-s MP,...] [-c CONTENT,...] [FUNCTION...]\n"
+    "  Time image8bit functions on synthetic images and print CSV results.\n"
+    "\n"
+    "OPTIONS:\n"
+    "  -j N            Use N threads in image operations (default 1)\n"
+    "  -r REPS         Timed runs of each function, after a warmup (default 3)\n"
+    "  -s MP,...       Image sizes, in megapixels (default 1,10,50)\n"
+    "  -c CONTENT,...  Image contents: noise, flat, gradient, repetitive\n"
+    "                  (default all)\n"
+    "  FUNCTION...     Only time these functions (default all), by name,\n"
+    "                  such as ImageBlur or ImageLocateBest/NCC\n"
+    "\n"
+    "  Unless named, the searches (ImageLocateAll, ImageLocateBest) only run\n"
+    "  on images of up to 10 MP, and ImageLocateAll not on flat images, where\n"
+    "  every position matches and it takes O(W*H*w*h) time.\n"
+    ;
+
+// Image contents
+
+#define TILE 64   // period of the repetitive content
+
+static uint64_t state = 88172645463325252ull;   // of the xorshift generator
+
+static uint8 randomLevel(void) {
+  state ^= state << 13;
+  state ^= state >> 7;
+  state ^= state << 17;
+  return (uint8)(state >> 24);
+}
+
+static Image create(int w, int h) {
+  Image img = ImageCreate(w, h, PixMax);
+  if (img == NULL) {
+    error(2, errno, "Creating %dx%d image: %s", w, h, ImageErrMsg());
+  }
+  return img;
+}
+
+// Create a w x h image with the given content.
+static Image generate(const char* content, int w, int h) {
+  Image img = create(w, h);
+  if (strcmp(content, "noise") == 0) {
+    for (int y = 0; y < h; y++) {
+      for (int x = 0; x < w; x++) {
+        ImageSetPixel(img, x, y, randomLevel());
+      }
+    }
+  } else if (strcmp(content, "flat") == 0) {
+    ImageFill(img, 0, 0, w, h, PixMax / 2);
+  } else if (strcmp(content, "gradient") == 0) {
+    const long long d = (long long)w + h - 2 > 0 ? (long long)w + h - 2 : 1;
+    for (int y = 0; y < h; y++) {
+      for (int x = 0; x < w; x++) {
+        ImageSetPixel(img, x, y, (uint8)(((long long)x + y) * PixMax / d));
+      }
+    }
+  } else if (strcmp(content, "repetitive") == 0) {
+    Image tile = generate("noise", TILE, TILE);
+    for (int y = 0; y < h; y += TILE) {
+      for (int x = 0; x < w; x += TILE) {
+        // The last tiles of each row and column are cut to fit.
+        const int tw = w - x < TILE ? w - x : TILE;
+        const int th = h - y < TILE ? h - y : TILE;
+        Image part = ImageCropView(tile, 0, 0, tw, th);
+        if (part == NULL) {
+          error(2, errno, "Creating view: %s", ImageErrMsg());
+        }
+        ImagePaste(img, x, y, part);
+        ImageDestroy(&part);
+      }
+    }
+    ImageDestroy(&tile);
+  } else {
+    error(5, 0, "Invalid content: %s", content);
+  }
+  return img;
+}
+
+// Benchmark cases
+//
+// Each case is a function that runs one image8bit function on src (or on
+// work, a copy of src, if it modifies its image).  Results are destroyed
+// in the case, so their destruction is timed too.
+
+#define TEMPLATE 128   // size of the subimage to locate
+
+static Image src;        // the source image
+static Image work;       // a fresh copy of src, for in-place functions
+static Image other;      // another image of the same size (src mirrored)
+static Image copy;       // an exact copy of src
+static Image sub;        // a TEMPLATE x TEMPLATE crop near the end of src
+static char path[PATH_MAX];   // a file holding src
+
+// Check the result of a function that creates an image, and destroy it.
+static void consume(Image img, const char* name) {
+  if (img == NULL) {
+    error(2, errno, "%s: %s", name, ImageErrMsg());
+  }
+  ImageDestroy(&img);
+}
+
+static void countMatch(int x, int y, void* arg) {
+  ++*(int*)arg;
+}
+
+static void benchCreate(void) {
+  consume(ImageCreate(ImageWidth(src), ImageHeight(src), PixMax), "ImageCreate");
+}
+
+static void benchLoad(void) {
+  consume(ImageLoad(path), "ImageLoad");
+}
+
+static void benchLoadMapped(void) {
+  consume(ImageLoadMapped(path), "ImageLoadMapped");
+}
+
+static void benchSave(void) {
+  if (!ImageSave(src, path)) {
+    error(2, errno, "ImageSave %s: %s", path, ImageErrMsg());
+  }
+}
+
+static void benchStreamRead(void) {
+  ImageStream s = ImageStreamOpen(path);
+  Image band = s != NULL ? ImageCreate(ImageStreamWidth(s), TILE, PixMax) : NULL;
+  if (band == NULL) {
+    error(2, errno, "ImageStreamRead %s: %s", path, ImageErrMsg());
+  }
+  const int h = ImageStreamHeight(s);
+  for (int y = 0; y < h; y += TILE) {
+    Image rows = ImageCropView(band, 0, 0, ImageWidth(band), h - y < TILE ? h - y : TILE);
+    if (rows == NULL || !ImageStreamRead(s, y, rows)) {
+      error(2, errno, "ImageStreamRead %s: %s", path, ImageErrMsg());
+    }
+    ImageDestroy(&rows);
+  }
+  ImageDestroy(&band);
+  ImageStreamClose(&s);
+}
+
+static void benchStreamWrite(void) {
+  const int h = ImageHeight(src);
+  ImageStream s = ImageStreamCreate(path, ImageWidth(src), h, (uint8)ImageMaxval(src));
+  for (int y = 0; s != NULL && y < h; y += TILE) {
+    if (!ImageStreamWrite(s, src, y, h - y < TILE ? h : y + TILE)) break;
+  }
+  if (s == NULL || !ImageStreamClose(&s)) {
+    error(2, errno, "ImageStreamWrite %s: %s", path, ImageErrMsg());
+  }
+}
+
+static void benchStats(void) {
+  uint8 min = PixMax, max = 0;
+  ImageStats(src, &min, &max);
+}
+
+static volatile unsigned sink;   // so that reads are not optimized away
+
+static void benchGetPixel(void) {
+  const int w = ImageWidth(src);
+  const int h = ImageHeight(src);
+  unsigned sum = 0;
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) {
+      sum += ImageGetPixel(src, x, y);
+    }
+  }
+  sink = sum;
+}
+
+static void benchSetPixel(void) {
+  const int w = ImageWidth(work);
+  const int h = ImageHeight(work);
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) {
+      ImageSetPixel(work, x, y, (uint8)(x ^ y));
+    }
+  }
+}
+
+static void benchApplyLUT(void) {
+  uint8 lut[256];
+  for (int v = 0; v < 256; v++) {
+    lut[v] = (uint8)(PixMax - v);
+  }
+  ImageApplyLUT(work, lut);
+}
+
+static void benchNegative(void) { ImageNegative(work); }
+static void benchThreshold(void) { ImageThreshold(work, 128); }
+static void benchBrighten(void) { ImageBrighten(work, 1.3); }
+static void benchGamma(void) { ImageGamma(work, 0.8); }
+static void benchLevels(void) { ImageLevels(work, 20, 230); }
+static void benchContrastStretch(void) { ImageContrastStretch(work); }
+
+static void benchFill(void) {
+  ImageFill(work, 0, 0, ImageWidth(work), ImageHeight(work), 77);
+}
+
+static void benchRotate(void) { consume(ImageRotate(src), "ImageRotate"); }
+static void benchRotateCW(void) { consume(ImageRotateCW(src), "ImageRotateCW"); }
+static void benchRotate180(void) { consume(ImageRotate180(src), "ImageRotate180"); }
+static void benchMirror(void) { consume(ImageMirror(src), "ImageMirror"); }
+static void benchFlipVertical(void) { consume(ImageFlipVertical(src), "ImageFlipVertical"); }
+
+static void benchTransform(void) {
+  uint8 lut[256];
+  for (int v = 0; v < 256; v++) {
+    lut[v] = (uint8)(PixMax - v);
+  }
+  consume(ImageTransform(src, 1, 1, 1, lut), "ImageTransform");
+}
+
+static void benchCrop(void) {
+  consume(ImageCrop(src, 0, 0, ImageWidth(src), ImageHeight(src)), "ImageCrop");
+}
+
+static void benchMaterialize(void) {
+  Image view = ImageCropView(src, 0, 0, ImageWidth(src), ImageHeight(src));
+  if (view == NULL || !ImageMaterialize(view)) {
+    error(2, errno, "ImageMaterialize: %s", ImageErrMsg());
+  }
+  ImageDestroy(&view);
+}
+
+static void benchPaste(void) { ImagePaste(work, 0, 0, other); }
+static void benchBlend(void) { ImageBlend(work, 0, 0, other, 0.3); }
+
+static void benchMatchSubImage(void) {
+  if (!ImageMatchSubImage(src, 0, 0, copy)) {
+    error(2, 0, "ImageMatchSubImage: no match");
+  }
+}
+
+static void benchLocateSubImage(void) {
+  int x, y;
+  if (!ImageLocateSubImage(src, &x, &y, sub)) {
+    error(2, 0, "ImageLocateSubImage: not found");
+  }
+}
+
+static void benchLocateAll(void) {
+  int count = 0;
+  if (ImageLocateAll(src, sub, countMatch, &count, 0) < 1) {
+    error(2, errno, "ImageLocateAll: %s", ImageErrMsg());
+  }
+}
+
+static void locateBest(ImageMatchMethod method) {
+  int x, y;
+  double score;
+  if (!ImageLocateBest(src, sub, method, &x, &y, &score)) {
+    error(2, errno, "ImageLocateBest: %s", ImageErrMsg());
+  }
+}
+
+static void benchLocateBestSAD(void) { locateBest(IMAGE_MATCH_SAD); }
+static void benchLocateBestNCC(void) { locateBest(IMAGE_MATCH_NCC); }
+
+static void benchBlur(void) { ImageBlur(work, 3, 3); }
+
+typedef struct {
+  const char* name;
+  void (*run)(void);
+  int inplace;     // modifies work, which must be restored before each run
+  double maxmp;    // unless named, only run on images of up to maxmp MP (or any, if 0)
+  const char* slow;  // unless named, do not run on this content (or NULL)
+} Bench;
+
+#define SEARCH_MAX_MP 10.0
+
+static const Bench BENCHES[] = {
+  { "ImageCreate", benchCreate, 0 },
+  { "ImageLoad", benchLoad, 0 },
+  { "ImageLoadMapped", benchLoadMapped, 0 },
+  { "ImageSave", benchSave, 0 },
+  { "ImageStreamRead", benchStreamRead, 0 },
+  { "ImageStreamWrite", benchStreamWrite, 0 },
+  { "ImageStats", benchStats, 0 },
+  { "ImageGetPixel", benchGetPixel, 0 },
+  { "ImageSetPixel", benchSetPixel, 1 },
+  { "ImageApplyLUT", benchApplyLUT, 1 },
+  { "ImageNegative", benchNegative, 1 },
+  { "ImageThreshold", benchThreshold, 1 },
+  { "ImageBrighten", benchBrighten, 1 },
+  { "ImageGamma", benchGamma, 1 },
+  { "ImageLevels", benchLevels, 1 },
+  { "ImageContrastStretch", benchContrastStretch, 1 },
+  { "ImageFill", benchFill, 1 },
+  { "ImageRotate", benchRotate, 0 },
+  { "ImageRotateCW", benchRotateCW, 0 },
+  { "ImageRotate180", benchRotate180, 0 },
+  { "ImageMirror", benchMirror, 0 },
+  { "ImageFlipVertical", benchFlipVertical, 0 },
+  { "ImageTransform", benchTransform, 0 },
+  { "ImageCrop", benchCrop, 0 },
+  { "ImageMaterialize", benchMaterialize, 0 },
+  { "ImagePaste", benchPaste, 1 },
+  { "ImageBlend", benchBlend, 1 },
+  { "ImageMatchSubImage", benchMatchSubImage, 0 },
+  { "ImageLocateSubImage", benchLocateSubImage, 0 },
+  { "ImageLocateAll", benchLocateAll, 0, SEARCH_MAX_MP, "flat" },
+  { "ImageLocateBest/SAD", benchLocateBestSAD, 0, SEARCH_MAX_MP },
+  { "ImageLocateBest/NCC", benchLocateBestNCC, 0, SEARCH_MAX_MP },
+  { "ImageBlur", benchBlur, 1 },
+};
+#define NBENCHES (sizeof(BENCHES) / sizeof(BENCHES[0]))
+
+// Time one case on the current images, and print its CSV line.
+static void runBench(const Bench* b, const char* content, int threads, int reps) {
+  const int w = ImageWidth(src);
+  const int h = ImageHeight(src);
+  fprintf(stderr, "%s on %dx%d %s\n", b->name, w, h, content);
+  double best = INFINITY;
+  double total = 0.0;
+  unsigned long count[NUMCOUNTERS];
+  for (int r = -1; r < reps; r++) {   // run -1 is the warmup
+    if (b->inplace) {
+      ImagePaste(work, 0, 0, src);
+    }
+    InstrReset();
+    const double t0 = wall_time();
+    b->run();
+    const double time = wall_time() - t0;
+    InstrTotals(count);
+    if (r >= 0) {
+      best = time < best ? time : best;
+      total += time;
+    }
+  }
+  const double pixels = (double)w * h;
+  printf("%s,%s,%d,%d,%.3f,%d,%d,%.6f,%.6f,%.2f,%.3f", b->name, content, w, h,
+         pixels / 1e6, threads, reps, best, total / reps,
+         pixels / 1e6 / best, best * 1e9 / pixels);
+  for (int i = 0; i < NUMCOUNTERS; i++) {
+    if (InstrName[i] != NULL) {
+      printf(",%lu", count[i]);
+    }
+  }
+  putchar('\n');
+  fflush(stdout);
+}
+
+// Does list (comma-separated) contain item?  An empty list contains all.
+static int listed(const char* list, const char* item) {
+  if (list == NULL) return 1;
+  const size_t n = strlen(item);
+  for (const char* p = list; p != NULL; p = strchr(p, ',')) {
+    if (*p == ',') p++;
+    if (strncmp(p, item, n) == 0 && (p[n] == ',' || p[n] == '\0')) return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char* argv[]) {
+  program_name = argv[0];
+  ImageInit();
+
+  int threads = 1;
+  int reps = 3;
+  const char* sizes = "1,10,50";
+  const char* contents = NULL;
+  int k = 1;
+  for (; k < argc && argv[k][0] == '-'; k += 2) {
+    if (k + 1 >= argc) {
+      error(5, 0, "\n%s", USAGE);
+    } else if (strcmp(argv[k], "-j") == 0) {
+      if (sscanf(argv[k+1], "%d", &threads) != 1 || threads < 1) {
+        error(5, 0, "Invalid number of threads: %s", argv[k+1]);
+      }
+    } else if (strcmp(argv[k], "-r") == 0) {
+      if (sscanf(argv[k+1], "%d", &reps) != 1 || reps < 1) {
+        error(5, 0, "Invalid number of repetitions: %s", argv[k+1]);
+      }
+    } else if (strcmp(argv[k], "-s") == 0) {
+      sizes = argv[k+1];
+    } else if (strcmp(argv[k], "-c") == 0) {
+      contents = argv[k+1];
+    } else {
+      error(5, 0, "\n%s", USAGE);
+    }
+  }
+  ImageSetThreads(threads);
+
+  // Only the benchmarks named in argv[k..], if any (2 if named)
+  int selected[NBENCHES];
+  for (size_t b = 0; b < NBENCHES; b++) {
+    selected[b] = k == argc;
+  }
+  for (int j = k; j < argc; j++) {
+    size_t b = 0;
+    while (b < NBENCHES && strcmp(argv[j], BENCHES[b].name) != 0) b++;
+    if (b == NBENCHES) {
+      error(5, 0, "Unknown function: %s", argv[j]);
+    }
+    selected[b] = 2;
+  }
+
+  const char* dir = getenv("TMPDIR");
+  snprintf(path, sizeof(path), "%s/imageBenchXXXXXX", dir != NULL ? dir : "/tmp");
+  const int fd = mkstemp(path);
+  if (fd < 0) {
+    error(2, errno, "Creating %s", path);
+  }
+  close(fd);
+
+  printf("function,content,width,height,megapixels,threads,reps,"
+         "best_s,mean_s,mp_per_s,ns_per_pixel");
+  for (int i = 0; i < NUMCOUNTERS; i++) {
+    if (InstrName[i] != NULL) {
+      printf(",%s", InstrName[i]);
+    }
+  }
+  putchar('\n');
+
+  static const char* const CONTENTS[] = { "noise", "flat", "gradient", "repetitive" };
+  for (const char* p = sizes; p != NULL; p = strchr(p, ',')) {
+    if (*p == ',') p++;
+    double mp;
+    if (sscanf(p, "%lf", &mp) != 1 || !(mp > 0.0 && mp <= 2000.0)) {
+      error(5, 0, "Invalid size: %s", p);
+    }
+    // 4:3 images
+    const int w = (int)ceil(sqrt(mp * 1e6 * 4 / 3));
+    const int h = (int)ceil(mp * 1e6 / w);
+    for (size_t c = 0; c < sizeof(CONTENTS) / sizeof(CONTENTS[0]); c++) {
+      if (!listed(contents, CONTENTS[c])) continue;
+      fprintf(stderr, "Generating %dx%d %s image\n", w, h, CONTENTS[c]);
+      src = generate(CONTENTS[c], w, h);
+      work = create(w, h);
+      other = ImageMirror(src);
+      copy = ImageCrop(src, 0, 0, w, h);
+      const int t = TEMPLATE < w && TEMPLATE < h ? TEMPLATE : (w < h ? w : h);
+      sub = ImageCrop(src, w - t - (w - t) / 16, h - t - (h - t) / 16, t, t);
+      if (other == NULL || copy == NULL || sub == NULL || !ImageSave(src, path)) {
+        unlink(path);
+        error(2, errno, "Preparing images: %s", ImageErrMsg());
+      }
+      for (size_t b = 0; b < NBENCHES; b++) {
+        const Bench* bench = &BENCHES[b];
+        if (selected[b] == 1 &&
+            ((bench->maxmp > 0.0 && mp > bench->maxmp) ||
+             (bench->slow != NULL && strcmp(bench->slow, CONTENTS[c]) == 0))) {
+          fprintf(stderr, "%s on %dx%d %s skipped (name it to run it)\n",
+                  bench->name, w, h, CONTENTS[c]);
+        } else if (selected[b]) {
+          runBench(bench, CONTENTS[c], threads, reps);
+        }
+      }
+      ImageDestroy(&sub);
+      ImageDestroy(&copy);
+      ImageDestroy(&other);
+      ImageDestroy(&work);
+      ImageDestroy(&src);
+    }
+  }
+  unlink(path);
+  return 0;
+}
@@ -0,0 +1,191 @@
+// imageBigTest - Check the image8bit module on an image with more than 4
+// gigapixels.
+//
+// Such an image has pixel indices that do not fit in an int (nor in 32
+// bits).  To exercise them without needing gigabytes of memory or disk, this
+// program creates a sparse PGM file (all black, except for a few marker
+// pixels), maps it with ImageLoadMapped, and only touches small regions of
+// it: marker pixels, views and crops at the far corner, and single rows
+// read by streaming.  Then it creates an image of the same size, which the
+// pool of buffers maps from the system, zeroed lazily (pages only read are
+// all the same zero page), and makes full passes over it.
+//
+// You may freely use and modify this code, NO WARRANTY, blah blah,
+// as long as you give proper credit to the original and subsequent authors.
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "error.h"
+#include "image8bit.h"
+
+#define W 80000
+#define H 54000   // W*H = 4.32e9 > 2^32
+
+// Marker pixels, by linear index in the raster
+static const long long MARKERS[] = {
+  0,
+  (1LL << 31) + 5,          // beyond INT_MAX
+  (1LL << 32) + 7,          // beyond UINT32_MAX
+  (long long)W * H - 1,     // last pixel
+};
+#define NMARKERS (sizeof(MARKERS) / sizeof(MARKERS[0]))
+
+static uint8 markerLevel(size_t m) {
+  return (uint8)(10 + 20 * m);
+}
+
+static int failures = 0;
+
+static void expect(int condition, const char* what) {
+  printf("# %s: %s\n", what, condition ? "OK" : "FAILED");
+  failures += !condition;
+}
+
+// Create a sparse W x H PGM file with the marker pixels.
+static void createFile(char* filename) {
+  int fd = mkstemp(filename);
+  if (fd < 0) {
+    error(2, errno, "Creating %s", filename);
+  }
+  char header[64];
+  const int len = snprintf(header, sizeof(header), "P5\n%d %d\n255\n", W, H);
+  if (write(fd, header, (size_t)len) != len ||
+      ftruncate(fd, (off_t)len + (off_t)W * H) != 0) {
+    error(2, errno, "Writing %s", filename);
+  }
+  for (size_t m = 0; m < NMARKERS; m++) {
+    const uint8 level = markerLevel(m);
+    if (pwrite(fd, &level, 1, (off_t)len + MARKERS[m]) != 1) {
+      error(2, errno, "Writing %s", filename);
+    }
+  }
+  close(fd);
+}
+
+int main(int argc, char* argv[]) {
+  program_name = argv[0];
+  ImageInit();
+
+  const char* dir = getenv("TMPDIR");
+  char filename[PATH_MAX];
+  snprintf(filename, sizeof(filename), "%s/imageBigTestXXXXXX", dir != NULL ? dir : "/tmp");
+  createFile(filename);
+
+  Image img = ImageLoadMapped(filename);
+  if (img == NULL) {
+    unlink(filename);
+    error(2, errno, "Loading %s: %s", filename, ImageErrMsg());
+  }
+  expect(ImageWidth(img) == W && ImageHeight(img) == H, "size");
+
+  // Pixels at indices beyond 32 bits
+  int ok = 1;
+  for (size_t m = 0; m < NMARKERS; m++) {
+    const int x = (int)(MARKERS[m] % W);
+    const int y = (int)(MARKERS[m] / W);
+    ok = ok && ImageGetPixel(img, x, y) == markerLevel(m);
+  }
+  expect(ok, "marker pixels");
+
+  expect(!ImageValidRect(img, W - 1, 0, INT_MAX, 1) &&
+         !ImageValidRect(img, 0, H - 1, 1, INT_MAX) &&
+         ImageValidRect(img, W - 64, H - 64, 64, 64), "valid rects");
+
+  // A view of the far corner: changes are seen in the image (copy-on-write
+  // pages of the mapping, not the file).
+  Image view = ImageCropView(img, W - 64, H - 64, 64, 64);
+  if (view == NULL) {
+    error(2, errno, "Creating view: %s", ImageErrMsg());
+  }
+  ImageNegative(view);
+  expect(ImageGetPixel(img, W - 1, H - 1) == 255 - markerLevel(NMARKERS - 1) &&
+         ImageGetPixel(img, W - 64, H - 64) == 255 &&
+         ImageGetPixel(img, W - 65, H - 64) == 0, "view of far corner");
+
+  // Copies and searches in the far corner
+  Image crop = ImageCrop(img, W - 32, H - 32, 32, 32);
+  if (crop == NULL) {
+    error(2, errno, "Cropping: %s", ImageErrMsg());
+  }
+  int px = -1, py = -1;
+  expect(ImageMatchSubImage(img, W - 32, H - 32, crop) &&
+         ImageLocateSubImage(view, &px, &py, crop) && px == 32 && py == 32,
+         "crop and locate in far corner");
+
+  ImageFill(crop, 0, 0, 32, 32, 77);
+  ImagePaste(img, W - 40, H - 100, crop);
+  expect(ImageGetPixel(img, W - 40, H - 100) == 77 &&
+         ImageGetPixel(img, W - 9, H - 69) == 77 &&
+         ImageGetPixel(img, W - 8, H - 69) == 0, "paste in far corner");
+
+  // Streaming reads of far rows (from the file, which is not changed)
+  ImageStream s = ImageStreamOpen(filename);
+  Image row = ImageCreate(W, 1, 255);
+  if (s == NULL || row == NULL) {
+    error(2, errno, "Streaming: %s", ImageErrMsg());
+  }
+  const int m2 = 2;
+  ok = ImageStreamRead(s, (int)(MARKERS[m2] / W), row) &&
+       ImageGetPixel(row, (int)(MARKERS[m2] % W), 0) == markerLevel(m2) &&
+       ImageStreamRead(s, H - 1, row) &&
+       ImageGetPixel(row, W - 1, 0) == markerLevel(NMARKERS - 1);
+  expect(ok, "streaming far rows");
+  ImageStreamClose(&s);
+
+  ImageDestroy(&row);
+  ImageDestroy(&crop);
+  ImageDestroy(&view);
+  ImageDestroy(&img);
+  unlink(filename);
+
+  // A created image of the same size
+  Image big = ImageCreate(W, H, 255);
+  if (big == NULL) {
+    error(2, errno, "Creating %dx%d image: %s", W, H, ImageErrMsg());
+  }
+  uint8 min = 255, max = 0;
+  ImageStats(big, &min, &max);
+  expect(min == 0 && max == 0, "created image is black (full pass)");
+
+  // Fill the rows around pixel index 2^32, through a view, and a marker
+  // right at 2^32.
+  const long long p32 = 1LL << 32;
+  const int y32 = (int)(p32 / W);
+  const int x32 = (int)(p32 % W);
+  Image band = ImageCropView(big, 0, y32 - 1, W, 3);
+  if (band == NULL) {
+    error(2, errno, "Creating view: %s", ImageErrMsg());
+  }
+  ImageFill(band, 0, 0, W, 3, 100);
+  ImageSetPixel(band, x32, 1, 200);
+  expect(ImageGetPixel(big, x32, y32) == 200 &&
+         ImageGetPixel(big, x32 - 1, y32) == 100 &&
+         ImageGetPixel(big, x32 + 1, y32) == 100 &&
+         ImageGetPixel(big, W - 1, y32 + 1) == 100 &&
+         ImageGetPixel(big, 0, y32 + 2) == 0 &&
+         ImageGetPixel(big, W - 1, y32 - 2) == 0, "fill across index 2^32");
+  min = 255;
+  max = 0;
+  ImageStats(big, &min, &max);
+  expect(min == 0 && max == 200, "stats after fill (full pass)");
+  min = 255;
+  max = 0;
+  ImageStats(band, &min, &max);
+  expect(min == 100 && max == 200, "stats of the view");
+
+  ImageDestroy(&band);
+  ImageDestroy(&big);
+
+  // Too large to allocate (but not to count): fails cleanly
+  Image huge = ImageCreate(INT_MAX, INT_MAX, 255);
+  expect(huge == NULL && errno == ENOMEM, "creating INT_MAX x INT_MAX fails");
+
+  if (failures > 0) {
+    error(1, 0, "%d checks failed", failures);
+  }
+  return 0;
+}
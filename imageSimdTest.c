@@ -0,0 +1,113 @@
+// imageSimdTest - Check the vectorized row kernels against the scalar ones.
+//
+// For every instruction set supported by the running CPU, this program
+// applies each row kernel of image8bitSimd to random rows of many lengths
+// and alignments, and checks that the results are identical to those of
+// the scalar kernels.
+//
+// You may freely use and modify this code, NO WARRANTY, blah blah,
+// as long as you give proper credit to the original and subsequent authors.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "error.h"
+#include "image8bitSimd.h"
+
+#define MAXLEN 300
+
+static const char* SETS[] = { "sse2", "avx2" };
+
+static const double ALPHAS[] = { 0.0, 0.33, 0.5, 1.0, 0.999, 1.5, -0.7, 3.0 };
+
+static const uint8 MAXVALS[] = { 255, 100, 1 };
+
+static const uint8 THRS[] = { 0, 1, 77, 128, 255 };
+
+// Fill p[0..n-1] with random levels (some of them above maxval).
+static void randomRow(uint8* p, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    p[i] = (uint8)(rand() & 0xff);
+  }
+}
+
+// Compare kernel table k to the scalar one.  Returns number of failures.
+static int check(const PixKernels* k) {
+  const PixKernels* s = &PixKernelsScalar;
+  uint8 src[MAXLEN + 32];
+  uint8 a[MAXLEN + 32];
+  uint8 b[MAXLEN + 32];
+  int failures = 0;
+
+  for (size_t n = 0; n <= MAXLEN; ++n) {
+    for (size_t off = 0; off < 32; off += 7) {
+      randomRow(src, n + off);
+      for (size_t m = 0; m < sizeof(MAXVALS); ++m) {
+        const uint8 maxval = MAXVALS[m];
+
+        memcpy(a, src, n + off);
+        memcpy(b, src, n + off);
+        s->negative(a + off, n, maxval);
+        k->negative(b + off, n, maxval);
+        if (memcmp(a, b, n + off) != 0) {
+          printf("FAIL %s negative n=%zu off=%zu maxval=%d\n", k->name, n, off, maxval);
+          failures++;
+        }
+
+        for (size_t t = 0; t < sizeof(THRS); ++t) {
+          memcpy(a, src, n + off);
+          memcpy(b, src, n + off);
+          s->threshold(a + off, n, THRS[t], maxval);
+          k->threshold(b + off, n, THRS[t], maxval);
+          if (memcmp(a, b, n + off) != 0) {
+            printf("FAIL %s threshold n=%zu off=%zu thr=%d\n", k->name, n, off, THRS[t]);
+            failures++;
+          }
+        }
+
+        for (size_t al = 0; al < sizeof(ALPHAS) / sizeof(ALPHAS[0]); ++al) {
+          randomRow(a, n + off);
+          memcpy(b, a, n + off);
+          s->blend(a + off, src, n, ALPHAS[al], maxval);
+          k->blend(b + off, src, n, ALPHAS[al], maxval);
+          if (memcmp(a, b, n + off) != 0) {
+            printf("FAIL %s blend n=%zu off=%zu alpha=%f\n", k->name, n, off, ALPHAS[al]);
+            failures++;
+          }
+        }
+      }
+
+      uint8 min1 = 200, max1 = 50;
+      uint8 min2 = 200, max2 = 50;
+      s->minmax(src + off, n, &min1, &max1);
+      k->minmax(src + off, n, &min2, &max2);
+      if (min1 != min2 || max1 != max2) {
+        printf("FAIL %s minmax n=%zu off=%zu\n", k->name, n, off);
+        failures++;
+      }
+    }
+  }
+  return failures;
+}
+
+int main(int argc, char* argv[]) {
+  program_name = argv[0];
+  srand(12345);
+
+  int failures = 0;
+  for (size_t i = 0; i < sizeof(SETS) / sizeof(SETS[0]); ++i) {
+    const PixKernels* k = PixKernelsSelect(SETS[i]);
+    if (k == NULL) {
+      printf("# %s: not supported, skipped\n", SETS[i]);
+      continue;
+    }
+    const int f = check(k);
+    printf("# %s: %s\n", k->name, f == 0 ? "OK" : "FAILED");
+    failures += f;
+  }
+
+  if (failures > 0) {
+    error(1, 0, "%d kernel mismatches", failures);
+  }
+  return 0;
+}
@@ -15,12 +15,20 @@
 #include <errno.h>
 #include "error.h"
 #include <assert.h>
+#include <glob.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <time.h>
 
 #include "image8bit.h"
 #include "instrumentation.h"
 
 static const char* USAGE =
-    "USAGE: imageTool [FILE...] [OPERATION [OPERAND...]]\n"
+    "USAGE: imageTool [-j N] [-m] [-l] [-b ROWS] [--metrics=FMT] [--trace=FILE]\n"
+    "                 [FILE...] [OPERATION [OPERAND...]]\n"
+    "       imageTool [-j N] [-m] [-l] [--metrics=FMT] [--trace=FILE]\n"
+    "                 --batch PATTERN [--out DIR] [OPERATION [OPERAND...]]\n"
     "  Apply pipeline of image processing operations to PGM files.\n"
     "  Arguments are processed from left to right and may be\n"
     "  FILES, OPERATIONS, or OPERANDS to operations.\n"
@@ -30,6 +38,25 @@ static const char* USAGE =
     "  predecessor is PRED.\n"
     "  Most operations apply to CURR and some also use PRED.\n"
     "\n"
+    "OPTIONS:\n"
+    "  -j N            Use N threads in image operations (default 1),\n"
+    "                  or to process files in parallel, in batch mode\n"
+    "  -m              Map input files into memory, instead of reading them\n"
+    "  -l              Defer point operations (neg, thr, bri, gamma, levels) and\n"
+    "                  orientations (rotate..., mirror, flipv) until the image is\n"
+    "                  needed, then execute them all in a single pass\n"
+    "  -b ROWS         Stream a single FILE in bands of ROWS rows, through band\n"
+    "                  operations (neg, thr, bri, gamma, levels, blur), to save FILE\n"
+    "  --batch PATTERN Apply the operations to each file matching PATTERN (quoted\n"
+    "                  wildcards), loaded as I0, and print the throughput\n"
+    "  --out DIR       In batch mode, a final save without FILE saves CURR to DIR,\n"
+    "                  with the name of the input file\n"
+    "  --metrics=FMT   Print a record of metrics for each operation, in format\n"
+    "                  FMT: json (one object per line) or csv\n"
+    "  --trace=FILE    Write a timeline of the operations, their phases and\n"
+    "                  threads, and the counters, to FILE, in Chrome trace\n"
+    "                  format (to view in Perfetto or chrome://tracing)\n"
+    "\n"
     "FILES:\n"
     "  Currently, only image files in 8-bit raw PGM format are accepted.\n"
     "  Input file names must be distinct from operation names.\n"
@@ -40,20 +67,33 @@ static const char* USAGE =
     "  info            Show information on CURR (size and range)\n"
     "  tic             Reset instrumentation counters and times.\n"
     "  toc             Print instrumentation counters and times.\n"
+    "                  (In batch mode, tic and toc apply to the whole batch.)\n"
     "\n"              
     "  neg             Apply photo-negative effect to CURR\n"
     "  thr LEVEL       Apply thresholding to CURR\n"
     "  bri FACTOR      Scale brightness in CURR by FACTOR\n"
+    "  gamma GAMMA     Apply gamma correction to CURR\n"
+    "  levels LO,HI    Map levels [LO,HI] in CURR to [0,maxval]\n"
+    "  stretch         Stretch contrast in CURR to [0,maxval]\n"
+    "  fill X,Y,W,H,LEVEL  Fill a rectangle of CURR with LEVEL\n"
     "\n"              
     "  create W,H      Create new black image with WxH pixels\n"
     "  rotate          Rotate CURR 90º counter-clockwise, creating new image\n"
+    "  rotatecw        Rotate CURR 90º clockwise, creating new image\n"
+    "  rotate180       Rotate CURR 180º, creating new image\n"
     "  mirror          Mirror CURR left-to-right, creating new image\n"
+    "  flipv           Flip CURR top-to-bottom, creating new image\n"
     "  crop X,Y,W,H    Crop a rectangle from CURR, creating new image\n"
+    "  view X,Y,W,H    Create a view of a rectangle of CURR (sharing its pixels)\n"
+    "  materialize     Give CURR its own copy of its pixels\n"
     "\n"              
     "  paste X,Y       Paste PRED into CURR at position (X,Y)\n"
     "  blend X,Y,alpha Blend PRED into CURR at position (X,Y) with given alpha\n"
     "\n"              
     "  locate          Search PRED in CURR, print matching position, or NOTFOUND\n"
+    "  locateall       Search PRED in CURR, print all matching positions\n"
+    "  match METHOD    Search best approximate match of PRED in CURR, print\n"
+    "                  position and score (METHOD is sad or ncc)\n"
     "\n"              
     "  blur DX,DY      blur CURR using (2DX+1)x(2Dy+1) mean filter\n"
     "\n"              
@@ -74,8 +114,369 @@ static char* errors[] = {
   "Invalid operand",
   "Invalid rect (overflow)",
   "Invalid alpha",
+  "Invalid levels",
+  "Operation not supported in band streaming",
+  "No files match the batch pattern",
+  "Cannot create output directory",
+  "Some files of the batch failed",
+  "Cannot write trace file",
+};
+
+
+// Print a match found by ImageLocateAll.
+static void printMatch(int x, int y, void* arg) {
+  printf("# FOUND (%d,%d)\n", x, y);
+}
+
+// Deferred execution
+//
+// With -l, point operations and orientations are not executed at once, but
+// recorded, for each buffered image, as one lookup table and one orientation
+// (in the terms of ImageTransform).  The image is only built, in a single
+// pass, when an operation needs its pixels.  So "neg thr 128 bri .5" reads
+// and writes the image once, not three times, and "rotate mirror" creates
+// no intermediate image.
+//
+// Point operations are composed by applying them to the table itself: a
+// 256x1 image holding every level, so the result is exactly that of the
+// eager operations.  They do not move pixels, so they commute with the
+// orientations.  An image with pending orientations is a view of the image
+// it derives from, which is never modified afterwards (only CURR is), so it
+// can be shared.
+
+typedef struct {
+  Image lut;                     // levels (pixel v of row 0 maps level v), or NULL
+  int transpose, flipx, flipy;   // orientation
+  int shared;                    // pixels shared with other deferred images?
+} Pending;
+
+// Operations that need the actual pixels of CURR, and of PRED too.
+static const char* const NEEDS_CURR[] = {
+  "info", "save", "stretch", "fill", "crop", "view", "materialize", "blur",
+  "paste", "blend", "locate", "locateall", "match", NULL
 };
+static const char* const NEEDS_PRED[] = {
+  "paste", "blend", "locate", "locateall", "match", NULL
+};
+
+static int isIn(const char* op, const char* const list[]) {
+  for (int i = 0; list[i] != NULL; i++) {
+    if (strcmp(op, list[i]) == 0) return 1;
+  }
+  return 0;
+}
+
+// The image a point operation on img should apply to: img itself or, if
+// deferring, the lookup table pending on it (created as needed).
+// Returns NULL on failure.
+static Image pointTarget(int lazy, Image img, Pending* p) {
+  if (!lazy) return img;
+  if (p->lut == NULL) {
+    p->lut = ImageCreate(256, 1, (uint8)ImageMaxval(img));
+    if (p->lut == NULL) return NULL;
+    for (int v = 0; v < 256; v++) {
+      ImageSetPixel(p->lut, v, 0, (uint8)v);
+    }
+  }
+  return p->lut;
+}
+
+// Defer an orientation of img (with pending p): returns a view of the
+// pixels of img, and sets q to the operations pending on it.
+// Returns NULL on failure.
+static Image deferOrient(Image img, Pending* p, Pending* q, int transpose, int flipx, int flipy) {
+  Image out = ImageCropView(img, 0, 0, ImageWidth(img), ImageHeight(img));
+  if (out == NULL) return NULL;
+  *q = *p;
+  if (p->lut != NULL) {
+    q->lut = ImageCrop(p->lut, 0, 0, 256, 1);
+    if (q->lut == NULL) { ImageDestroy(&out); return NULL; }
+  }
+  // Pixel (u, v) of the new result comes from pixel (a, b) of the old one
+  // (or (b, a)); express that in terms of the pixels of img.
+  if (transpose) {
+    const int fx = flipx ^ q->flipy;
+    q->flipy = flipy ^ q->flipx;
+    q->flipx = fx;
+    q->transpose = !q->transpose;
+  } else {
+    q->flipx ^= flipx;
+    q->flipy ^= flipy;
+  }
+  p->shared = q->shared = 1;
+  return out;
+}
+
+// Execute the operations pending on *img, so it holds its actual pixels.
+// If it will be written, it must not share them.
+// Returns 0 on failure.
+static int flush(Image* img, Pending* p, int write) {
+  const int oriented = p->transpose || p->flipx || p->flipy;
+  if (p->lut == NULL && !oriented && !(write && p->shared)) return 1;
+  uint8 table[256];
+  if (p->lut != NULL) {
+    for (int v = 0; v < 256; v++) {
+      table[v] = ImageGetPixel(p->lut, v, 0);
+    }
+  }
+  const uint8* lut = p->lut != NULL ? table : NULL;
+  if (!oriented && !p->shared) {
+    ImageApplyLUT(*img, table);
+  } else {
+    Image out = ImageTransform(*img, p->transpose, p->flipx, p->flipy, lut);
+    if (out == NULL) return 0;
+    ImageDestroy(img);
+    *img = out;
+    p->shared = 0;
+  }
+  ImageDestroy(&p->lut);
+  p->transpose = p->flipx = p->flipy = 0;
+  return 1;
+}
+
+// Band streaming
+//
+// With -b ROWS, the arguments must be: an input FILE, band operations, and
+// save FILE.  The input is processed in bands of ROWS rows: each band is
+// read together with the rows around it that blur needs (the halo, the sum
+// of the DY of all blurs), transformed, and written out before the next
+// band is read.  So memory use is proportional to the width of the image
+// times ROWS plus the halo, and images larger than memory can be processed.
+// The output is identical to that of the same operations on the whole image.
+
+// Apply the band operation at av[*k] (and its operands) to band.
+// If band is NULL, only check the operation, and add its halo to *halo.
+// Advances *k to the last operand.  Returns an error code (0 if valid).
+static int bandOp(int ac, char* av[], int* k, Image band, long long* halo) {
+  if (strcmp(av[*k], "neg") == 0) {
+    if (band != NULL) ImageNegative(band);
+  } else if (strcmp(av[*k], "thr") == 0) {
+    if (++*k >= ac) return 1;
+    uint8 thr;
+    if (sscanf(av[*k], "%hhu", &thr) != 1) return 5;
+    if (band != NULL) ImageThreshold(band, thr);
+  } else if (strcmp(av[*k], "bri") == 0) {
+    if (++*k >= ac) return 1;
+    double factor;
+    if (sscanf(av[*k], "%lf", &factor) != 1) return 5;
+    if (band != NULL) ImageBrighten(band, factor);
+  } else if (strcmp(av[*k], "gamma") == 0) {
+    if (++*k >= ac) return 1;
+    double gamma;
+    if (sscanf(av[*k], "%lf", &gamma) != 1) return 5;
+    if (!(gamma > 0.0)) return 5;   // precondition check!
+    if (band != NULL) ImageGamma(band, gamma);
+  } else if (strcmp(av[*k], "levels") == 0) {
+    if (++*k >= ac) return 1;
+    uint8 lo, hi;
+    if (sscanf(av[*k], "%hhu,%hhu", &lo, &hi) != 2) return 5;
+    if (lo >= hi) return 8;   // precondition check!
+    if (band != NULL) ImageLevels(band, lo, hi);
+  } else if (strcmp(av[*k], "blur") == 0) {
+    if (++*k >= ac) return 1;
+    int dx; int dy;
+    if (sscanf(av[*k], "%d,%d", &dx, &dy) != 2) return 5;
+    if (dx < 0 || dy < 0) return 5;   // precondition check!
+    if (band != NULL) ImageBlur(band, dx, dy);
+    else *halo += dy;
+  } else {
+    return 9;
+  }
+  return 0;
+}
+
+// Run the band streaming pipeline in av[k..ac-1], in bands of rows rows.
+// Returns an error code (0 on success).
+static int streamBands(int ac, char* av[], int k, int rows) {
+  // Check the arguments: FILE OPERATION... save FILE
+  if (k >= ac) return 1;
+  const char* input = av[k++];
+  const int first = k;
+  long long halo = 0;
+  for (; k < ac && strcmp(av[k], "save") != 0; k++) {
+    const int err = bandOp(ac, av, &k, NULL, &halo);
+    if (err != 0) return err;
+  }
+  if (k + 1 >= ac) return 1;
+  if (k + 2 < ac) return 9;   // nothing may follow save
+  const int last = k;
+  const char* output = av[k + 1];
+
+  ImageStream in = ImageStreamOpen(input);
+  if (in == NULL) return 4;
+  const int w = ImageStreamWidth(in);
+  const int h = ImageStreamHeight(in);
+  ImageStream out = ImageStreamCreate(output, w, h, (uint8)ImageStreamMaxval(in));
+  if (out == NULL) { ImageStreamClose(&in); return 4; }
+  if (rows > h) rows = h;
+  if (halo > h) halo = h;
+  fprintf(stderr, "Streaming %s -> %s in bands of %d+2*%lld rows\n", input, output, rows, halo);
+
+  // The band, with its halo, is a view of the top rows of buffer.
+  Image buffer = ImageCreate(w, (int)(rows + 2 * halo < h ? rows + 2 * halo : h),
+                             (uint8)ImageStreamMaxval(in));
+  int success = buffer != NULL;
+  for (int y0 = 0; success && y0 < h; y0 += rows) {
+    const int y1 = h - y0 > rows ? y0 + rows : h;
+    const int r0 = y0 > halo ? y0 - (int)halo : 0;
+    const int r1 = h - y1 > halo ? y1 + (int)halo : h;
+    Image band = ImageCropView(buffer, 0, 0, w, r1 - r0);
+    success = band != NULL && ImageStreamRead(in, r0, band);
+    for (int j = first; success && j < last; j++) {
+      bandOp(ac, av, &j, band, NULL);
+    }
+    success = success && ImageStreamWrite(out, band, y0 - r0, y1 - r0);
+    ImageDestroy(&band);
+  }
+  ImageDestroy(&buffer);
+  ImageStreamClose(&in);
+  success = ImageStreamClose(&out) && success;
+  return success ? 0 : 4;
+}
+
+// Options common to all pipelines
+static Image (*load)(const char*) = ImageLoad;   // how to load files (-m)
+static int lazy = 0;                              // defer operations? (-l)
+static enum { NO_METRICS, JSON, CSV } metrics = NO_METRICS;  // (--metrics)
+static int tracing = 0;                           // (--trace)
+
+// Metrics
+//
+// With --metrics=FMT, a record is printed to stdout after each operation
+// that succeeds, for monitoring tools to ingest: the run (0, or the index of
+// the file in batch mode), the operation and its operand, the size of CURR
+// before and after it (0 if none), its wall-clock and cpu times, the pixels
+// of CURR after it per second of wall time, and the increments of the named
+// instrumentation counters.  Records are JSON objects, one per line, or CSV
+// rows after a header.  (Other output lines, from info, locate or toc, are
+// not records: most start with '#'.)
+//
+// In batch mode, each worker thread runs the operations itself, so its cpu
+// time and its own block of counters are measured; otherwise, those of the
+// whole process.  With -l, deferred operations take no time, and the
+// operation that needs the image pays for them.
+//
+// With --trace=FILE, each operation is also a span of the trace (around
+// the spans of its phases, recorded by image8bit), followed by the values
+// of the counters.
+
+typedef struct {
+  int perThread;                // measure the calling thread only?
+  int inw, inh;                 // size of CURR before
+  double wall, cpu;             // times before
+  unsigned long count[NUMCOUNTERS];   // counters before
+} Metrics;
+
+static double threadCpuTime(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+  return (double)t.tv_sec + 1e-9 * (double)t.tv_nsec;
+}
+
+static void readCounters(int perThread, unsigned long count[NUMCOUNTERS]) {
+  if (perThread) {
+    memcpy(count, InstrThreadCounters(), NUMCOUNTERS * sizeof(count[0]));
+  } else {
+    InstrTotals(count);
+  }
+}
+
+// Print s as a JSON string, or a CSV field.
+static void printString(const char* s) {
+  putchar('"');
+  for (; *s != '\0'; s++) {
+    const unsigned char c = (unsigned char)*s;
+    if (metrics == CSV) {
+      if (c == '"') putchar('"');
+      putchar(c);
+    } else if (c == '"' || c == '\\') {
+      printf("\\%c", c);
+    } else if (c < 0x20) {
+      printf("\\u%04x", c);
+    } else {
+      putchar(c);
+    }
+  }
+  putchar('"');
+}
+
+// Print the CSV header.
+static void metricsHeader(void) {
+  if (metrics != CSV) return;
+  printf("run,op,arg,in_width,in_height,out_width,out_height,wall,cpu,pixels_per_s");
+  for (int i = 0; i < NUMCOUNTERS; i++) {
+    if (InstrName[i] != NULL) printf(",%s", InstrName[i]);
+  }
+  printf("\n");
+}
+
+// Get the size of curr (NULL if none), with operations p pending on it.
+static void sizeOf(Image curr, const Pending* p, int* w, int* h) {
+  *w = curr != NULL ? ImageWidth(curr) : 0;
+  *h = curr != NULL ? ImageHeight(curr) : 0;
+  if (curr != NULL && p->transpose) {
+    const int t = *w; *w = *h; *h = t;
+  }
+}
+
+// Start measuring an operation on CURR (NULL if none), with p pending.
+static void metricsStart(Metrics* m, Image curr, const Pending* p) {
+  if (metrics == NO_METRICS && !tracing) return;
+  sizeOf(curr, p, &m->inw, &m->inh);
+  readCounters(m->perThread, m->count);
+  m->wall = wall_time();
+  m->cpu = m->perThread ? threadCpuTime() : cpu_time();
+}
+
+// Finish measuring operation op (with operand arg, or NULL) of run, which
+// left CURR (NULL if none) with p pending, and print its record.
+static void metricsEnd(Metrics* m, int run, const char* op, const char* arg,
+                       Image curr, const Pending* p) {
+  if (metrics == NO_METRICS && !tracing) return;
+  const double wall = wall_time() - m->wall;
+  const double cpu = (m->perThread ? threadCpuTime() : cpu_time()) - m->cpu;
+  unsigned long count[NUMCOUNTERS];
+  readCounters(m->perThread, count);
+  if (tracing) {
+    InstrTraceSpan(op, arg, m->wall);
+    InstrTraceCounters(count, m->perThread);
+  }
+  if (metrics == NO_METRICS) return;
+  int outw, outh;
+  sizeOf(curr, p, &outw, &outh);
+  const double rate = wall > 0.0 ? (double)outw * outh / wall : 0.0;
 
+  flockfile(stdout);   // one record at a time, in batch mode
+  if (metrics == JSON) {
+    printf("{\"run\":%d,\"op\":", run);
+    printString(op);
+    printf(",\"arg\":");
+    printString(arg != NULL ? arg : "");
+    printf(",\"in_width\":%d,\"in_height\":%d,\"out_width\":%d,\"out_height\":%d",
+           m->inw, m->inh, outw, outh);
+    printf(",\"wall\":%.6f,\"cpu\":%.6f,\"pixels_per_s\":%.0f", wall, cpu, rate);
+  } else {
+    printf("%d,", run);
+    printString(op);
+    putchar(',');
+    printString(arg != NULL ? arg : "");
+    printf(",%d,%d,%d,%d,%.6f,%.6f,%.0f", m->inw, m->inh, outw, outh, wall, cpu, rate);
+  }
+  for (int i = 0; i < NUMCOUNTERS; i++) {
+    if (InstrName[i] == NULL) continue;
+    // After a tic, counters restart from zero.
+    const unsigned long d = count[i] >= m->count[i] ? count[i] - m->count[i] : count[i];
+    if (metrics == JSON) {
+      putchar(',');
+      printString(InstrName[i]);
+      printf(":%lu", d);
+    } else {
+      printf(",%lu", d);
+    }
+  }
+  printf(metrics == JSON ? "}\n" : "\n");
+  funlockfile(stdout);
+}
 
 // This program strives for correctness and robustness.
 // You may want to temporarily comment out operand validation, namely
@@ -85,28 +486,35 @@ static char* errors[] = {
 // Also, the program does not test every module function, but you may easily
 // add new operations for that purpose.
 
-int main(int ac, char* av[]) {
-  program_name = av[0];
-  if (ac <= 1) {
-    error(5, 0, "\n%s", USAGE);
-  }
-
-  ImageInit();
-
+// Run the pipeline of operations in av[k..ac-1], on a new image buffer.
+// Adds the number of pixels of the files loaded to *pixels.
+// Metrics records are for the given run; in batch mode, they measure
+// the calling thread only.
+// Returns an error code (0 on success).
+static int runPipeline(int ac, char* av[], int k, int run, int batch, long long* pixels) {
   int err = 0;
   int x, y, w, h;
+  Metrics m = { .perThread = batch };
 
   // The image buffer
   const int N = 10;   // buffer capacity
   Image img[N];     // the images
+  Pending pend[N];    // operations pending on them (with -l)
   int n = 0;          // number of images created
+  memset(pend, 0, sizeof(pend));
 
-  int k = 1;
   while (k < ac) {
+    const int op = k;
+    const char* name = av[k];   // of the operation, for metrics
+    const char* arg = NULL;     // and its operand
+    metricsStart(&m, n > 0 ? img[n-1] : NULL, &pend[n > 0 ? n-1 : 0]);
+    // CURR may be written, PRED is only read
+    if (n >= 2 && isIn(av[k], NEEDS_PRED) && !flush(&img[n-2], &pend[n-2], 0)) { err = 4; break; }
+    if (n >= 1 && isIn(av[k], NEEDS_CURR) && !flush(&img[n-1], &pend[n-1], 1)) { err = 4; break; }
     if (strcmp(av[k], "info") == 0) {
       if (n < 1) { err = 2; break; }
       fprintf(stderr, "Info on I%d\n", n-1);
-      uint8 min, max;
+      uint8 min = PixMax, max = 0;   // ImageStats only lowers/raises them
       w = ImageWidth(img[n-1]);
       h = ImageHeight(img[n-1]);
       uint8 maxval = ImageMaxval(img[n-1]);
@@ -114,27 +522,66 @@ int main(int ac, char* av[]) {
       printf("# Size: %dx%d\n# Maxval: %hhu\n", w, h, maxval);
       printf("# Gray level range: [%hhu, %hhu]\n", min, max);
     } else if (strcmp(av[k], "tic") == 0) {
-      InstrReset();
+      if (!batch) InstrReset();   // see runBatch
     } else if (strcmp(av[k], "toc") == 0) {
-      InstrPrint();
+      if (!batch) InstrPrint();
     } else if (strcmp(av[k], "neg") == 0) {
       if (n < 1) { err = 2; break; }
       fprintf(stderr, "Negating I%d\n", n-1);
-      ImageNegative(img[n-1]);
+      Image target = pointTarget(lazy, img[n-1], &pend[n-1]);
+      if (target == NULL) { err = 4; break; }
+      ImageNegative(target);
     } else if (strcmp(av[k], "thr") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
       uint8 thr;
       if (sscanf(av[k], "%hhu", &thr) != 1) { err = 5; break; }
       fprintf(stderr, "Thresholding I%d at %d\n", n-1, thr);
-      ImageThreshold(img[n-1], (uint8)thr);
+      Image target = pointTarget(lazy, img[n-1], &pend[n-1]);
+      if (target == NULL) { err = 4; break; }
+      ImageThreshold(target, (uint8)thr);
     } else if (strcmp(av[k], "bri") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
       double factor;
       if (sscanf(av[k], "%lf", &factor) != 1) { err = 5; break; }
       fprintf(stderr, "Brightening I%d by %lf\n", n-1, factor);
-      ImageBrighten(img[n-1], factor);
+      Image target = pointTarget(lazy, img[n-1], &pend[n-1]);
+      if (target == NULL) { err = 4; break; }
+      ImageBrighten(target, factor);
+    } else if (strcmp(av[k], "gamma") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      double gamma;
+      if (sscanf(av[k], "%lf", &gamma) != 1) { err = 5; break; }
+      if (!(gamma > 0.0)) { err = 5; break; }   // precondition check!
+      fprintf(stderr, "Gamma correcting I%d by %lf\n", n-1, gamma);
+      Image target = pointTarget(lazy, img[n-1], &pend[n-1]);
+      if (target == NULL) { err = 4; break; }
+      ImageGamma(target, gamma);
+    } else if (strcmp(av[k], "levels") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      uint8 lo, hi;
+      if (sscanf(av[k], "%hhu,%hhu", &lo, &hi) != 2) { err = 5; break; }
+      if (lo >= hi) { err = 8; break; }   // precondition check!
+      fprintf(stderr, "Levels I%d from [%d,%d]\n", n-1, lo, hi);
+      Image target = pointTarget(lazy, img[n-1], &pend[n-1]);
+      if (target == NULL) { err = 4; break; }
+      ImageLevels(target, lo, hi);
+    } else if (strcmp(av[k], "stretch") == 0) {
+      if (n < 1) { err = 2; break; }
+      fprintf(stderr, "Stretching contrast of I%d\n", n-1);
+      ImageContrastStretch(img[n-1]);
+    } else if (strcmp(av[k], "fill") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      uint8 level;
+      if (sscanf(av[k], "%d,%d,%d,%d,%hhu", &x, &y, &w, &h, &level) != 5) { err = 5; break; }
+      if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 5; break; }   // precondition check!
+      if (level > ImageMaxval(img[n-1])) { err = 5; break; }   // precondition check!
+      fprintf(stderr, "Filling I%d (%d,%d,%d,%d) with %d\n", n-1, x, y, w, h, level);
+      ImageFill(img[n-1], x, y, w, h, level);
     } else if (strcmp(av[k], "create") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n >= N) { err = 3; break; }
@@ -148,14 +595,40 @@ int main(int ac, char* av[]) {
       if (n < 1) { err = 2; break; }
       if (n >= N) { err = 3; break; }
       fprintf(stderr, "Rotating I%d -> I%d\n", n-1, n);
-      img[n] = ImageRotate(img[n-1]);
+      img[n] = lazy ? deferOrient(img[n-1], &pend[n-1], &pend[n], 1, 0, 1)
+                    : ImageRotate(img[n-1]);
+      if (img[n] == NULL) { err = 4; break; }
+      n++;
+    } else if (strcmp(av[k], "rotatecw") == 0) {
+      if (n < 1) { err = 2; break; }
+      if (n >= N) { err = 3; break; }
+      fprintf(stderr, "Rotating I%d clockwise -> I%d\n", n-1, n);
+      img[n] = lazy ? deferOrient(img[n-1], &pend[n-1], &pend[n], 1, 1, 0)
+                    : ImageRotateCW(img[n-1]);
+      if (img[n] == NULL) { err = 4; break; }
+      n++;
+    } else if (strcmp(av[k], "rotate180") == 0) {
+      if (n < 1) { err = 2; break; }
+      if (n >= N) { err = 3; break; }
+      fprintf(stderr, "Rotating I%d by 180º -> I%d\n", n-1, n);
+      img[n] = lazy ? deferOrient(img[n-1], &pend[n-1], &pend[n], 0, 1, 1)
+                    : ImageRotate180(img[n-1]);
       if (img[n] == NULL) { err = 4; break; }
       n++;
     } else if (strcmp(av[k], "mirror") == 0) {
       if (n < 1) { err = 2; break; }
       if (n >= N) { err = 3; break; }
       fprintf(stderr, "Mirroring I%d -> I%d\n", n-1, n);
-      img[n] = ImageMirror(img[n-1]);
+      img[n] = lazy ? deferOrient(img[n-1], &pend[n-1], &pend[n], 0, 1, 0)
+                    : ImageMirror(img[n-1]);
+      if (img[n] == NULL) { err = 4; break; }
+      n++;
+    } else if (strcmp(av[k], "flipv") == 0) {
+      if (n < 1) { err = 2; break; }
+      if (n >= N) { err = 3; break; }
+      fprintf(stderr, "Flipping I%d top-to-bottom -> I%d\n", n-1, n);
+      img[n] = lazy ? deferOrient(img[n-1], &pend[n-1], &pend[n], 0, 0, 1)
+                    : ImageFlipVertical(img[n-1]);
       if (img[n] == NULL) { err = 4; break; }
       n++;
     } else if (strcmp(av[k], "crop") == 0) {
@@ -168,6 +641,20 @@ int main(int ac, char* av[]) {
       img[n] = ImageCrop(img[n-1], x, y, w, h);
       if (img[n] == NULL) { err = 4; break; }
       n++;
+    } else if (strcmp(av[k], "view") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      if (n >= N) { err = 3; break; }
+      if (sscanf(av[k], "%d,%d,%d,%d", &x, &y, &w, &h) != 4) { err = 5; break; }
+      if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 5; break; }   // precondition check!
+      fprintf(stderr, "Viewing I%d (%d,%d,%d,%d) -> I%d\n", n-1, x, y, w, h, n);
+      img[n] = ImageCropView(img[n-1], x, y, w, h);
+      if (img[n] == NULL) { err = 4; break; }
+      n++;
+    } else if (strcmp(av[k], "materialize") == 0) {
+      if (n < 1) { err = 2; break; }
+      fprintf(stderr, "Materializing I%d\n", n-1);
+      if (ImageMaterialize(img[n-1]) == 0) { err = 4; break; }
     } else if (strcmp(av[k], "paste") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 2) { err = 2; break; }
@@ -195,6 +682,31 @@ int main(int ac, char* av[]) {
       } else {
         printf("# NOTFOUND\n");
       }
+    } else if (strcmp(av[k], "locateall") == 0) {
+      if (n < 2) { err = 2; break; }
+      w = ImageWidth(img[n-2]);
+      h = ImageHeight(img[n-2]);
+      if (!ImageValidRect(img[n-1], 0, 0, w, h)) { err = 6; break; }   // precondition check!
+      fprintf(stderr, "Locating all I%d in I%d\n", n-2, n-1);
+      int count = ImageLocateAll(img[n-1], img[n-2], printMatch, NULL, 0);
+      if (count < 0) { err = 4; break; }
+      printf("# MATCHES: %d\n", count);
+    } else if (strcmp(av[k], "match") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 2) { err = 2; break; }
+      ImageMatchMethod method;
+      if (strcmp(av[k], "sad") == 0) {
+        method = IMAGE_MATCH_SAD;
+      } else if (strcmp(av[k], "ncc") == 0) {
+        method = IMAGE_MATCH_NCC;
+      } else { err = 5; break; }
+      w = ImageWidth(img[n-2]);
+      h = ImageHeight(img[n-2]);
+      if (!ImageValidRect(img[n-1], 0, 0, w, h)) { err = 6; break; }   // precondition check!
+      fprintf(stderr, "Matching I%d in I%d by %s\n", n-2, n-1, av[k]);
+      double score;
+      if (!ImageLocateBest(img[n-1], img[n-2], method, &x, &y, &score)) { err = 4; break; }
+      printf("# BEST (%d,%d) SCORE %g\n", x, y, score);
     } else if (strcmp(av[k], "blur") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
@@ -208,18 +720,219 @@ int main(int ac, char* av[]) {
       fprintf(stderr, "Saving %s <- I%d\n", av[k], n-1);
       if (ImageSave(img[n-1], av[k]) == 0) { err = 4; break; }
     } else {  // image file
+      name = "load";
+      arg = av[k];
       if (n >= N) { err = 3; break; }
       fprintf(stderr, "Loading %s -> I%d\n", av[k], n);
-      img[n] = ImageLoad(av[k]);
+      img[n] = load(av[k]);
       if (img[n] == NULL) { err = 4; break; }
+      *pixels += (long long)ImageWidth(img[n]) * ImageHeight(img[n]);
       n++;
     }
+    if (k > op) arg = av[k];
+    metricsEnd(&m, run, name, arg, n > 0 ? img[n-1] : NULL, &pend[n > 0 ? n-1 : 0]);
     k++;
   }
   
   // Destroy remaining images
   while (n > 0) {
-    ImageDestroy(&img[--n]);
+    ImageDestroy(&pend[--n].lut);
+    ImageDestroy(&img[n]);
+  }
+  return err;
+}
+
+
+// Batch mode
+//
+// With --batch PATTERN, the pipeline is applied to every file matching
+// PATTERN (a shell wildcard pattern, see glob(3)), loaded as I0.  A final
+// save without file name saves CURR to the --out directory, under the name
+// of the input file.  The files are shared by the -j worker threads, each
+// with its own image buffer, so at most one image buffer per thread is in
+// memory at once.  Image operations then run serially, in their thread.
+// The instrumentation counters and times are shared by all threads, so tic
+// and toc apply to the whole batch: the main thread resets them before the
+// workers start, and prints them after they all finish (calibrating first,
+// if needed, while no worker runs).
+
+typedef struct {
+  int ac;             // the pipeline: av[k..ac-1]
+  char** av;
+  int k;
+  int save;           // does it end with save?
+  const char* outdir;
+  char** files;       // the input files
+  size_t nfiles;
+  pthread_mutex_t lock;   // protects the fields below
+  size_t next;        // next file to process
+  size_t failed;      // number of files that failed
+  long long pixels;   // number of pixels loaded
+} Batch;
+
+// Process files of the batch, until there are no more.
+static void* batchWorker(void* arg) {
+  Batch* b = (Batch*)arg;
+  char* args[b->ac - b->k + 2];
+  char path[PATH_MAX];
+  for (;;) {
+    pthread_mutex_lock(&b->lock);
+    const size_t i = b->next++;
+    pthread_mutex_unlock(&b->lock);
+    if (i >= b->nfiles) break;
+
+    // FILE OPERATION... [save PATH]
+    int na = 0;
+    args[na++] = b->files[i];
+    for (int j = b->k; j < b->ac; j++) {
+      args[na++] = b->av[j];
+    }
+    if (b->save) {
+      const char* name = strrchr(b->files[i], '/');
+      name = name != NULL ? name + 1 : b->files[i];
+      snprintf(path, sizeof(path), "%s/%s", b->outdir, name);
+      args[na++] = path;
+    }
+    long long pixels = 0;
+    const int err = runPipeline(na, args, 0, (int)i, 1, &pixels);
+    if (err != 0) {
+      const int errnum = errno;
+      char msg[256];
+      snprintf(msg, sizeof(msg), errors[err], ImageErrMsg());
+      error(0, errnum, "%s: %s", b->files[i], msg);
+    }
+
+    pthread_mutex_lock(&b->lock);
+    b->failed += err != 0;
+    b->pixels += pixels;
+    pthread_mutex_unlock(&b->lock);
+  }
+  return NULL;
+}
+
+// Run the pipeline in av[k..ac-1] on each file matching pattern, in
+// threads threads, and print the throughput.
+// Returns an error code (0 on success).
+static int runBatch(int ac, char* av[], int k, const char* pattern,
+                    const char* outdir, int threads) {
+  Batch b = { .ac = ac, .av = av, .k = k, .outdir = outdir,
+              .lock = PTHREAD_MUTEX_INITIALIZER };
+  b.save = k < ac && strcmp(av[ac-1], "save") == 0;
+  if (b.save && outdir == NULL) return 1;
+  if (b.save && mkdir(outdir, 0777) != 0 && errno != EEXIST) return 11;
+
+  glob_t g;
+  if (glob(pattern, 0, NULL, &g) != 0) { globfree(&g); return 10; }
+  b.files = g.gl_pathv;
+  b.nfiles = g.gl_pathc;
+  fprintf(stderr, "Batch of %zu files in %d threads\n", b.nfiles, threads);
+  int tic = 0, toc = 0;
+  for (int j = k; j < ac; j++) {
+    tic |= strcmp(av[j], "tic") == 0;
+    toc |= strcmp(av[j], "toc") == 0;
+  }
+  if (toc) InstrEnsureCalibrated();
+  if (tic) InstrReset();
+
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  // The calling thread is a worker too.
+  pthread_t workers[threads];
+  int started = 0;
+  while (started < threads - 1 &&
+         pthread_create(&workers[started], NULL, batchWorker, &b) == 0) {
+    started++;
+  }
+  batchWorker(&b);
+  for (int t = 0; t < started; t++) {
+    pthread_join(workers[t], NULL);
+  }
+  if (toc) InstrPrint();
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  const double time = (double)(t1.tv_sec - t0.tv_sec) + 1e-9 * (double)(t1.tv_nsec - t0.tv_nsec);
+
+  printf("# FILES: %zu (%zu failed) in %.3f s\n", b.nfiles, b.failed, time);
+  printf("# THROUGHPUT: %.1f files/s, %.1f MP/s\n",
+         (double)b.nfiles / time, (double)b.pixels / 1e6 / time);
+  globfree(&g);
+  return b.failed > 0 ? 12 : 0;
+}
+
+int main(int ac, char* av[]) {
+  program_name = av[0];
+  if (ac <= 1) {
+    error(5, 0, "\n%s", USAGE);
+  }
+
+  ImageInit();
+
+  int err = 0;
+
+  // Options
+  int threads = 1;    // number of threads
+  int rows = 0;       // band height, when streaming
+  const char* pattern = NULL;   // input files, in batch mode
+  const char* outdir = NULL;    // output directory, in batch mode
+  int k = 1;
+  for (;;) {
+    if (k + 1 < ac && strcmp(av[k], "-j") == 0) {
+      if (sscanf(av[k+1], "%d", &threads) != 1 || threads < 1) {
+        error(5, 0, "Invalid number of threads: %s", av[k+1]);
+      }
+      k += 2;
+    } else if (k < ac && strcmp(av[k], "-m") == 0) {
+      load = ImageLoadMapped;
+      k++;
+    } else if (k < ac && strcmp(av[k], "-l") == 0) {
+      lazy = 1;
+      k++;
+    } else if (k + 1 < ac && strcmp(av[k], "-b") == 0) {
+      if (sscanf(av[k+1], "%d", &rows) != 1 || rows < 1) {
+        error(5, 0, "Invalid number of rows: %s", av[k+1]);
+      }
+      k += 2;
+    } else if (k + 1 < ac && strcmp(av[k], "--batch") == 0) {
+      pattern = av[k+1];
+      k += 2;
+    } else if (k + 1 < ac && strcmp(av[k], "--out") == 0) {
+      outdir = av[k+1];
+      k += 2;
+    } else if (k < ac && strncmp(av[k], "--trace=", 8) == 0) {
+      if (!InstrTraceOpen(av[k] + 8)) {
+        error(5, errno, "Cannot open trace file: %s", av[k] + 8);
+      }
+      tracing = 1;
+      k++;
+    } else if (k < ac && strncmp(av[k], "--metrics=", 10) == 0) {
+      if (strcmp(av[k] + 10, "json") == 0) {
+        metrics = JSON;
+      } else if (strcmp(av[k] + 10, "csv") == 0) {
+        metrics = CSV;
+      } else {
+        error(5, 0, "Invalid metrics format: %s", av[k] + 10);
+      }
+      k++;
+    } else {
+      break;
+    }
+  }
+  if (pattern != NULL && rows > 0) {
+    error(5, 0, "Options -b and --batch cannot be used together");
+  }
+  if ((metrics != NO_METRICS || tracing) && rows > 0) {
+    error(5, 0, "Option -b cannot be used with --metrics or --trace");
+  }
+  metricsHeader();
+
+  if (pattern != NULL) {
+    err = runBatch(ac, av, k, pattern, outdir, threads);
+  } else {
+    ImageSetThreads(threads);
+    long long pixels = 0;
+    err = rows > 0 ? streamBands(ac, av, k, rows) : runPipeline(ac, av, k, 0, 0, &pixels);
+  }
+  if (tracing && !InstrTraceClose() && err == 0) {
+    err = 13;
   }
 
   error(err, errno, errors[err], ImageErrMsg());
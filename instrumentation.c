@@ -9,7 +9,6 @@
 /// // Name the counters you're going to use: 
 /// InstrName[0] = "memops";
 /// InstrName[1] = "adds";
-/// InstrCalibrate();  // Call once, to measure CTU
 /// ...
 /// InstrReset();  // reset to zero
 /// for (...) {
@@ -18,10 +17,31 @@
 ///   a[k] = a[i] + a[j];
 /// }
 /// InstrPrint();  // to show time and counters
+///
+/// The Calibrated Time Unit (CTU) is measured on the first InstrPrint,
+/// unless it was set before: by InstrCalibrate(), by assigning InstrCTU,
+/// or by the INSTR_CTU environment variable (in seconds).  If the
+/// INSTR_CTU_FILE environment variable names a file, the CTU is read from
+/// it, or measured once and saved in it, for later runs.
+///
+/// // In multithreaded code, count in the block of the running thread:
+/// unsigned long* count = InstrThreadCounters();
+/// count[0] += 3;
+///
+/// // Run with INSTR_PERF=1 to also show hardware counters (see InstrPerfInit).
+///
+/// // Gauges show the current value of some quantity:
+/// InstrGaugeName[0] = "bytes";
+/// InstrGauge[0] = bytesInUse;  // a function returning unsigned long
 
 #include "instrumentation.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 /// Cpu time in seconds
 double cpu_time(void) ; ///
@@ -42,6 +62,14 @@ double cpu_time(void) {
   return (double)current_time.tv_sec + 1.0e-9 * (double)current_time.tv_nsec;
 }
 
+double wall_time(void) {
+  struct timespec current_time;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &current_time) != 0)
+    return -1.0; // clock_gettime() failed!!!
+  return (double)current_time.tv_sec + 1.0e-9 * (double)current_time.tv_nsec;
+}
+
 #endif
 
 
@@ -66,6 +94,10 @@ double cpu_time(void) {
   return (double)current_time.QuadPart / (double)frequency.QuadPart;
 }
 
+double wall_time(void) {
+  return cpu_time();  // the performance counter is a wall clock already
+}
+
 #endif
 
 /// Array of operation counters:
@@ -76,11 +108,86 @@ char* InstrName[NUMCOUNTERS] = {NULL};  ///extern
     // All elements initialized to NULL
     // See: https://en.cppreference.com/w/c/language/array_initialization
 
+// Per-thread counters
+//
+// Each thread that asks for counters gets a block, aligned and padded to
+// a cache line (64 bytes), so no two threads ever write to the same line.
+// Blocks are kept in a list, to be added up by InstrPrint.  When a thread
+// exits, its block is marked free (keeping its counts), to be reused by a
+// later thread, so there are never more blocks than threads alive at once.
+
+typedef struct Block {
+  _Alignas(64) unsigned long count[NUMCOUNTERS];
+  struct Block* next;   // next block in the list
+  int free;             // the owner thread has exited
+} Block;
+
+// Protects the list of blocks.
+static pthread_mutex_t blocksLock = PTHREAD_MUTEX_INITIALIZER;
+static Block* blocks = NULL;
+
+// The block of the running thread.
+static _Thread_local unsigned long* threadCount = NULL;
+
+// A key whose destructor frees the block when its thread exits.
+static pthread_key_t blockKey;
+static pthread_once_t blockKeyOnce = PTHREAD_ONCE_INIT;
+
+static void freeBlock(void* block) {
+  pthread_mutex_lock(&blocksLock);
+  ((Block*)block)->free = 1;
+  pthread_mutex_unlock(&blocksLock);
+}
+
+static void createBlockKey(void) {
+  pthread_key_create(&blockKey, freeBlock);
+}
+
+/// Get the block of counters of the calling thread.
+unsigned long* InstrThreadCounters(void) { ///
+  if (threadCount != NULL)
+    return threadCount;
+  pthread_once(&blockKeyOnce, createBlockKey);
+  pthread_mutex_lock(&blocksLock);
+  Block* b = blocks;
+  while (b != NULL && !b->free)
+    b = b->next;
+  if (b == NULL) {
+    b = aligned_alloc(_Alignof(Block), sizeof(Block));
+    if (b != NULL) {
+      for (int i = 0; i < NUMCOUNTERS; i++)
+        b->count[i] = 0ul;
+      b->next = blocks;
+      blocks = b;
+    }
+  }
+  if (b != NULL)
+    b->free = 0;
+  pthread_mutex_unlock(&blocksLock);
+  if (b == NULL)
+    return InstrCount;  // no memory: share the global counters
+  pthread_setspecific(blockKey, b);
+  threadCount = b->count;
+  return threadCount;
+}
+
+/// Array of gauges:
+unsigned long (*InstrGauge[NUMGAUGES])(void) = {NULL};  ///extern
+
+/// Array of names for the gauges:
+char* InstrGaugeName[NUMGAUGES] = {NULL};  ///extern
+
 /// Cpu_time read on previous reset (~seconds)
 double InstrTime;  ///extern
 
-/// Calibrated Time Unit (in seconds, initially 1s)
-double InstrCTU = 1.0;  ///extern
+/// Wall_time read on previous reset (~seconds)
+double InstrWallTime;  ///extern
+
+/// Calibrated Time Unit (in seconds, 0 until calibrated)
+double InstrCTU = 0.0;  ///extern
+
+// Sink for the result of the calibration loop, so it is not optimized away.
+static volatile int calibrationSink;
 
 /// Find the Calibrated Time Unit (CTU).
 /// Run and time a loop of basic memory and arithmetic operations to set
@@ -88,42 +195,350 @@ double InstrCTU = 1.0;  ///extern
 void InstrCalibrate(void) { ///
   const int size = 4*1024;     // 2^12!
   const int mask = size - 1;
-  int array[size];  // alloc array in stack, not initialized on purpose
+  int array[size];
+  for (int i = 0; i < size; i++)
+    array[i] = i;
   double time = cpu_time();
-  srand((unsigned int)(time*1e9));
+  // Random indices come from an inline xorshift generator (Marsaglia, 2003),
+  // three 12-bit indices per step: much cheaper than three calls to rand().
+  uint64_t state = (uint64_t)(time*1e9) | 1u;
   for (int n = 0; n < 40000000; n++) {
-    int i = rand() & mask;
-    int j = rand() & mask;
-    int k = rand() & mask;
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    int i = (int)state & mask;
+    int j = (int)(state >> 12) & mask;
+    int k = (int)(state >> 24) & mask;
     array[k] ^= array[i] + array[j] + i*j;
-    //printf("%d %d %d\n", i, j, k);  // debug
   }
+  calibrationSink = array[0];
   InstrCTU = cpu_time() - time;
 }
 
-/// Reset counters to zero and store cpu_time.
+/// Set the CTU, if not set yet: from the INSTR_CTU environment variable,
+/// from the INSTR_CTU_FILE cache file, or by calibrating (and then saving it
+/// in the cache file, if any).
+void InstrEnsureCalibrated(void) { ///
+  if (InstrCTU > 0.0)
+    return;
+  const char* value = getenv("INSTR_CTU");
+  if (value != NULL && sscanf(value, "%lf", &InstrCTU) == 1 && InstrCTU > 0.0)
+    return;
+  const char* filename = getenv("INSTR_CTU_FILE");
+  if (filename != NULL) {
+    FILE* f = fopen(filename, "r");
+    if (f != NULL) {
+      const int ok = fscanf(f, "%lf", &InstrCTU) == 1 && InstrCTU > 0.0;
+      fclose(f);
+      if (ok)
+        return;
+    }
+  }
+  InstrCalibrate();
+  if (filename != NULL) {
+    FILE* f = fopen(filename, "w");
+    if (f != NULL) {  // just a cache: ignore failures
+      fprintf(f, "%.9g\n", InstrCTU);
+      fclose(f);
+    }
+  }
+}
+
+// Hardware performance counters
+//
+// On Linux, perf_event_open gives access to the counters of the CPU (its
+// performance monitoring unit).  Each event is opened on its own (they
+// cannot be read as a group while inherited), for the calling thread and
+// the threads it creates afterwards (inherit), in user space only.  When
+// there are more events than hardware counters, the kernel multiplexes
+// them, so values are scaled by the fraction of time each one was counting.
+// InstrReset stores the values read, and InstrPrint shows the differences.
+
+#define NUMPERF 6
+
+static const char* const perfName[NUMPERF] = {
+  "cycles", "instructions", "L1d-misses", "LLC-misses", "dTLB-misses", "branch-misses",
+};
+
+static int perfFd[NUMPERF] = { -1, -1, -1, -1, -1, -1 };  // -1 if not open
+static double perfStart[NUMPERF];   // values read on previous reset
+static int perfTried = 0;           // InstrPerfInit already called?
+
+#ifdef __linux__
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define CACHE_MISSES(cache) ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | \
+                             (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const struct {
+  uint32_t type;
+  uint64_t config;
+} perfEvent[NUMPERF] = {
+  { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+  { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+  { PERF_TYPE_HW_CACHE, CACHE_MISSES(PERF_COUNT_HW_CACHE_L1D) },
+  { PERF_TYPE_HW_CACHE, CACHE_MISSES(PERF_COUNT_HW_CACHE_LL) },
+  { PERF_TYPE_HW_CACHE, CACHE_MISSES(PERF_COUNT_HW_CACHE_DTLB) },
+  { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+};
+
+// Open event e.  Returns its file descriptor, or -1 (errno is set).
+static int perfOpen(int e) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = perfEvent[e].type;
+  attr.config = perfEvent[e].config;
+  attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  attr.inherit = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+// Read event e, scaled to the whole time it was enabled.
+static double perfRead(int e) {
+  uint64_t value[3];  // count, time enabled, time running
+  if (perfFd[e] < 0 || read(perfFd[e], value, sizeof(value)) != sizeof(value) ||
+      value[2] == 0)
+    return 0.0;
+  return (double)value[0] * ((double)value[1] / (double)value[2]);
+}
+
+#else
+
+static int perfOpen(int e) {
+  errno = ENOSYS;
+  return -1;
+}
+
+static double perfRead(int e) {
+  return 0.0;
+}
+
+#endif
+
+/// Open the hardware performance counters, if INSTR_PERF is set.
+void InstrPerfInit(void) { ///
+  if (perfTried)
+    return;
+  perfTried = 1;
+  // Start the wall clock too, so a toc without a previous tic measures
+  // from here (as cpu_time measures from the start of the process).
+  InstrWallTime = wall_time();
+  const char* value = getenv("INSTR_PERF");
+  if (value == NULL || value[0] == '\0' || strcmp(value, "0") == 0)
+    return;
+  int failed = 0;
+  int err = 0;
+  for (int e = 0; e < NUMPERF; e++) {
+    perfFd[e] = perfOpen(e);
+    if (perfFd[e] < 0) {
+      failed++;
+      err = errno;
+    }
+  }
+  if (failed > 0)
+    fprintf(stderr, "instrumentation: %d of %d hardware counters unavailable: %s\n",
+            failed, NUMPERF, strerror(err));
+}
+
+/// Get the totals of the counters: InstrCount plus the blocks of all threads.
+void InstrTotals(unsigned long total[NUMCOUNTERS]) { ///
+  for (int i = 0; i < NUMCOUNTERS; i++)
+    total[i] = InstrCount[i];
+  pthread_mutex_lock(&blocksLock);
+  for (Block* b = blocks; b != NULL; b = b->next)
+    for (int i = 0; i < NUMCOUNTERS; i++)
+      total[i] += b->count[i];
+  pthread_mutex_unlock(&blocksLock);
+}
+
+/// Reset counters to zero and store cpu_time and wall_time.
 void InstrReset(void) { ///
   for (int i = 0; i < NUMCOUNTERS; i++)
     InstrCount[i] = 0ul;
+  pthread_mutex_lock(&blocksLock);
+  for (Block* b = blocks; b != NULL; b = b->next)
+    for (int i = 0; i < NUMCOUNTERS; i++)
+      b->count[i] = 0ul;
+  pthread_mutex_unlock(&blocksLock);
+  InstrPerfInit();
+  for (int e = 0; e < NUMPERF; e++)
+    perfStart[e] = perfRead(e);
   InstrTime = cpu_time();
+  InstrWallTime = wall_time();
 }
 
-// Print times and all named counter values
+// Print times, all named counter values and all named gauge values
 void InstrPrint(void) { ///
   // elapsed time since last reset:
   double time = cpu_time() - InstrTime;
+  double walltime = wall_time() - InstrWallTime;
+  InstrEnsureCalibrated();
   // compute time in calibrated time units:
   double caltime = time / InstrCTU;
 
-  printf("#%14.15s\t%15.15s", "time", "caltime");
+  // add up the counters of all threads:
+  unsigned long count[NUMCOUNTERS];
+  InstrTotals(count);
+  // hardware counters since last reset:
+  double perf[NUMPERF];
+  for (int e = 0; e < NUMPERF; e++)
+    perf[e] = perfRead(e) - perfStart[e];
+
+  printf("#%14.15s\t%15.15s\t%15.15s", "time", "caltime", "walltime");
   for (int i = 0; i < NUMCOUNTERS; i++)
     if (InstrName[i] != NULL)
       printf("\t%15.15s", InstrName[i]);
+  for (int e = 0; e < NUMPERF; e++)
+    if (perfFd[e] >= 0)
+      printf("\t%15.15s", perfName[e]);
+  for (int i = 0; i < NUMGAUGES; i++)
+    if (InstrGaugeName[i] != NULL && InstrGauge[i] != NULL)
+      printf("\t%15.15s", InstrGaugeName[i]);
   puts("");
-  printf("%15.6f\t%15.6f", time, caltime);
+  printf("%15.6f\t%15.6f\t%15.6f", time, caltime, walltime);
   for (int i = 0; i < NUMCOUNTERS; i++)
     if (InstrName[i] != NULL)
-      printf("\t%15lu", InstrCount[i]);  
+      printf("\t%15lu", count[i]);
+  for (int e = 0; e < NUMPERF; e++)
+    if (perfFd[e] >= 0)
+      printf("\t%15.0f", perf[e]);
+  for (int i = 0; i < NUMGAUGES; i++)
+    if (InstrGaugeName[i] != NULL && InstrGauge[i] != NULL)
+      printf("\t%15lu", InstrGauge[i]());
   puts("");
 }
 
+
+// Tracing
+//
+// Events are written as they happen, one per line, in the JSON array
+// format of the Chrome trace event format, under a mutex.  Each thread gets
+// a small id, on its first event, which names its track.  Times are in
+// microseconds since InstrTraceOpen.
+// When not tracing, the functions only load the tracing flag: they take
+// no lock and read no clock.
+
+static atomic_int tracing = 0;      // is a trace open?
+static pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER;
+static FILE* traceFile = NULL;      // NULL when not tracing
+static double traceStart;           // wall_time at InstrTraceOpen
+static int traceEvents = 0;         // number of events written
+static int traceThreads = 0;        // number of thread ids given
+static _Thread_local int traceTid = -1;   // id of the calling thread
+
+// Write s as a JSON string.  Called with traceLock held.
+static void traceString(const char* s) {
+  fputc('"', traceFile);
+  for (; *s != '\0'; s++) {
+    const unsigned char c = (unsigned char)*s;
+    if (c == '"' || c == '\\')
+      fprintf(traceFile, "\\%c", c);
+    else if (c < 0x20)
+      fprintf(traceFile, "\\u%04x", c);
+    else
+      fputc(c, traceFile);
+  }
+  fputc('"', traceFile);
+}
+
+// Start an event of phase ph at time t, and lock the trace.
+// Returns 0 (without locking) if the trace was closed meanwhile.
+static int traceEvent(const char* ph, const char* name, double t) {
+  pthread_mutex_lock(&traceLock);
+  if (traceFile == NULL) {
+    pthread_mutex_unlock(&traceLock);
+    return 0;
+  }
+  if (traceTid < 0)
+    traceTid = traceThreads++;
+  fputs(traceEvents++ > 0 ? ",\n" : "\n", traceFile);
+  fprintf(traceFile, "{\"ph\":\"%s\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"name\":",
+          ph, traceTid, 1e6 * (t - traceStart));
+  traceString(name);
+  return 1;
+}
+
+// Write the detail argument (if any), end the event and unlock the trace.
+static void traceEndEvent(const char* detail) {
+  if (detail != NULL) {
+    fputs(",\"args\":{\"detail\":", traceFile);
+    traceString(detail);
+    fputc('}', traceFile);
+  }
+  fputc('}', traceFile);
+  pthread_mutex_unlock(&traceLock);
+}
+
+/// Start writing a trace to file path.
+int InstrTraceOpen(const char* path) { ///
+  FILE* f = fopen(path, "w");
+  if (f == NULL)
+    return 0;
+  fputc('[', f);
+  pthread_mutex_lock(&traceLock);
+  traceStart = wall_time();
+  traceEvents = 0;
+  traceFile = f;
+  atomic_store(&tracing, 1);
+  pthread_mutex_unlock(&traceLock);
+  return 1;
+}
+
+/// Finish the trace and close its file.
+int InstrTraceClose(void) { ///
+  pthread_mutex_lock(&traceLock);
+  FILE* f = traceFile;
+  traceFile = NULL;
+  atomic_store(&tracing, 0);
+  pthread_mutex_unlock(&traceLock);
+  if (f == NULL)
+    return 1;
+  fputs("\n]\n", f);
+  return fclose(f) == 0;
+}
+
+/// Begin a span in the calling thread.
+void InstrTraceBegin(const char* name, const char* detail) { ///
+  if (atomic_load_explicit(&tracing, memory_order_relaxed) &&
+      traceEvent("B", name, wall_time()))
+    traceEndEvent(detail);
+}
+
+/// End the last span begun in the calling thread.
+void InstrTraceEnd(void) { ///
+  if (atomic_load_explicit(&tracing, memory_order_relaxed) &&
+      traceEvent("E", "", wall_time()))
+    traceEndEvent(NULL);
+}
+
+/// Record a span of the calling thread that started at wall_time start.
+void InstrTraceSpan(const char* name, const char* detail, double start) { ///
+  if (!atomic_load_explicit(&tracing, memory_order_relaxed))
+    return;
+  const double end = wall_time();
+  if (traceEvent("X", name, start)) {
+    fprintf(traceFile, ",\"dur\":%.3f", 1e6 * (end - start));
+    traceEndEvent(detail);
+  }
+}
+
+/// Record the values of the named counters.
+void InstrTraceCounters(const unsigned long count[NUMCOUNTERS], int thread) { ///
+  if (!atomic_load_explicit(&tracing, memory_order_relaxed))
+    return;
+  const double t = wall_time();
+  for (int i = 0; i < NUMCOUNTERS; i++) {
+    if (InstrName[i] == NULL || !traceEvent("C", InstrName[i], t))
+      continue;
+    if (thread)
+      fprintf(traceFile, ",\"id\":%d", traceTid);
+    fprintf(traceFile, ",\"args\":{\"value\":%lu}", count[i]);
+    traceEndEvent(NULL);
+  }
+}
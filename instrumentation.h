@@ -9,7 +9,6 @@
 /// // Name the counters you're going to use: 
 /// InstrName[0] = "memops";
 /// InstrName[1] = "adds";
-/// InstrCalibrate();  // Call once, to measure CTU
 /// ...
 /// InstrReset();  // reset to zero
 /// for (...) {
@@ -18,6 +17,29 @@
 ///   a[k] = a[i] + a[j];
 /// }
 /// InstrPrint();  // to show time and counters
+///
+/// The Calibrated Time Unit (CTU) is measured on the first InstrPrint,
+/// unless it was set before: by InstrCalibrate(), by assigning InstrCTU,
+/// or by the INSTR_CTU environment variable (in seconds).  If the
+/// INSTR_CTU_FILE environment variable names a file, the CTU is read from
+/// it, or measured once and saved in it, for later runs.
+///
+/// // In multithreaded code, count in the block of the running thread:
+/// unsigned long* count = InstrThreadCounters();
+/// count[0] += 3;
+///
+/// // Run with INSTR_PERF=1 to also show hardware counters (see InstrPerfInit).
+///
+/// // Gauges show the current value of some quantity:
+/// InstrGaugeName[0] = "bytes";
+/// InstrGauge[0] = bytesInUse;  // a function returning unsigned long
+///
+/// // Trace spans of time, per thread, to view in Perfetto or chrome://tracing:
+/// InstrTraceOpen("trace.json");
+/// InstrTraceBegin("sort", NULL);
+/// ...
+/// InstrTraceEnd();
+/// InstrTraceClose();
 
 #ifndef INSTRUMENTATION_H
 #define INSTRUMENTATION_H
@@ -25,30 +47,114 @@
 /// Cpu time in seconds
 double cpu_time(void) ; ///
 
+/// Wall-clock (elapsed real) time in seconds
+double wall_time(void) ; ///
+
 /// Ten counters should be more than enough
 #define NUMCOUNTERS 10
 
 /// Array of operation counters:
 extern unsigned long InstrCount[NUMCOUNTERS];  ///extern
 
+/// Get the block of counters of the calling thread.
+/// Each thread gets its own block (on first call), padded to a cache line,
+/// so threads may count concurrently without races or false sharing.
+/// InstrReset and InstrPrint handle InstrCount and all the blocks, adding
+/// them up, so blocks are only an alternative to InstrCount.
+/// Returns InstrCount if there is no memory for a new block.
+unsigned long* InstrThreadCounters(void) ;
+
 /// Array of names for the counters:
 extern char* InstrName[NUMCOUNTERS];  ///extern
 
+/// Four gauges should be enough
+#define NUMGAUGES 4
+
+/// Array of gauges: functions that return the current value of some
+/// quantity (memory in use, for instance).  Unlike counters, gauges are
+/// not reset: InstrPrint shows their values at the time it is called.
+extern unsigned long (*InstrGauge[NUMGAUGES])(void);  ///extern
+
+/// Array of names for the gauges:
+extern char* InstrGaugeName[NUMGAUGES];  ///extern
+
 /// Cpu_time read on previous reset (~seconds)
 extern double InstrTime;  ///extern
 
-/// Calibrated Time Unit (in seconds, initially 1s)
+/// Wall_time read on previous reset (~seconds)
+extern double InstrWallTime;  ///extern
+
+/// Calibrated Time Unit (in seconds, 0 until calibrated)
 extern double InstrCTU;  ///extern
 
 /// Find the Calibrated Time Unit (CTU).
 /// Run and time a loop of basic memory and arithmetic operations to set
 /// a reasonably cpu-independent time unit.
+/// (Optional: InstrPrint calibrates when needed.)
 void InstrCalibrate(void) ;
 
-/// Reset counters to zero and store cpu_time.
+/// Set the CTU, if not set yet, as InstrPrint does: from INSTR_CTU, from
+/// the INSTR_CTU_FILE cache, or by calling InstrCalibrate.
+/// Calibration measures cpu time, so, in multithreaded programs, call this
+/// before starting threads that work while InstrPrint may run.
+void InstrEnsureCalibrated(void) ;
+
+/// Get the totals of the counters: InstrCount plus the blocks of all threads.
+/// Must not be called while other threads are counting.
+void InstrTotals(unsigned long total[NUMCOUNTERS]) ;
+
+/// Open hardware performance counters (Linux perf_event_open), if the
+/// INSTR_PERF environment variable is set (not empty, nor "0"): cycles,
+/// instructions, L1 data cache, last level cache and data TLB read misses,
+/// and branch mispredictions.  InstrPrint shows them after the operation
+/// counters.  The events the system does not allow (because of
+/// /proc/sys/kernel/perf_event_paranoid, or in a virtual machine, say) are
+/// reported once, on stderr, and left out.
+/// They count the calling thread and the threads it creates afterwards,
+/// so call this early, before starting other threads.  (Otherwise, the
+/// first InstrReset calls it.)  The first call also starts the wall clock
+/// that InstrPrint reads, until the next InstrReset.
+void InstrPerfInit(void) ;
+
+/// Reset counters to zero and store cpu_time and wall_time.
+/// Must not be called while other threads are counting.
 void InstrReset(void) ;
 
+/// Print times, all named counter values and all named gauge values.
+/// Counters are added up over InstrCount and the blocks of all threads.
+/// The cpu time is that of all threads, so with several threads working
+/// it may exceed the wall-clock time.
+/// Must not be called while other threads are counting.
 void InstrPrint(void) ;
 
+/// Start writing a trace of events to file path, in the Chrome trace event
+/// format (JSON), to view in Perfetto or chrome://tracing.
+/// Until it is closed, the functions below record events; otherwise, they
+/// only load an atomic flag (no lock, no clock).  They may be called from
+/// any thread: each thread has its own track.
+/// Returns 0 on failure (errno is set).
+int InstrTraceOpen(const char* path) ;
+
+/// Finish the trace and close its file.
+/// Returns 0 on failure (errno is set).
+int InstrTraceClose(void) ;
+
+/// Begin a span of time named name, in the calling thread, with an
+/// optional detail (may be NULL).  Spans nest: each must be ended, in the
+/// same thread, by InstrTraceEnd.
+void InstrTraceBegin(const char* name, const char* detail) ;
+
+/// End the last span begun in the calling thread.
+void InstrTraceEnd(void) ;
+
+/// Record a span of the calling thread, from wall_time start until now.
+/// (For spans whose name is only known at the end.)
+void InstrTraceSpan(const char* name, const char* detail, double start) ;
+
+/// Record the current values of the named counters, in counter tracks.
+/// If thread is nonzero, they are counters of the calling thread only (its
+/// block), and go in tracks of their own.
+void InstrTraceCounters(const unsigned long count[NUMCOUNTERS], int thread) ;
+
 #endif
 
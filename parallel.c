@@ -0,0 +1,135 @@
+/// A minimal thread pool for data-parallel loops.
+///
+/// See parallel.h.
+///
+/// The pool has (threads-1) worker threads, which sleep until a job is
+/// posted.  A job is a loop of n independent calls fn(arg, i).  The calling
+/// thread posts the job, then takes part in it like any worker: each thread
+/// repeatedly grabs the next index i and calls fn(arg, i), until all indices
+/// are taken.  The caller then waits for the calls still in progress.
+
+#include "parallel.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+// Protects all the pool state below.
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+// Signalled when a new job is posted (or the workers must quit).
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+// Signalled when the last call of a job finishes.
+static pthread_cond_t done = PTHREAD_COND_INITIALIZER;
+
+// Held by the thread running a job: only one job at a time.
+static pthread_mutex_t busy = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_t* workers = NULL;
+static int nworkers = 0;
+static int quit = 0;
+
+// The current job
+static void (*jobFn)(void* arg, int i);
+static void* jobArg;
+static int jobN;          // number of calls
+static int jobNext;       // next index to take
+static int jobFinished;   // number of calls finished
+static unsigned jobId;    // incremented for each new job
+
+// Set in threads that are running calls of a job.
+static _Thread_local int inJob = 0;
+
+// Take and run calls of the current job, until there are no more.
+// Called with lock held.
+static void work(void) {
+  inJob = 1;
+  while (jobNext < jobN) {
+    const int i = jobNext++;
+    pthread_mutex_unlock(&lock);
+    jobFn(jobArg, i);
+    pthread_mutex_lock(&lock);
+    if (++jobFinished == jobN) {
+      pthread_cond_signal(&done);
+    }
+  }
+  inJob = 0;
+}
+
+static void* workerMain(void* unused) {
+  unsigned seen = 0;
+  pthread_mutex_lock(&lock);
+  seen = jobId;
+  for (;;) {
+    while (!quit && jobId == seen) {
+      pthread_cond_wait(&wake, &lock);
+    }
+    if (quit) break;
+    seen = jobId;
+    work();
+  }
+  pthread_mutex_unlock(&lock);
+  return NULL;
+}
+
+// Stop and join all worker threads.
+static void stopWorkers(void) {
+  pthread_mutex_lock(&lock);
+  quit = 1;
+  pthread_cond_broadcast(&wake);
+  pthread_mutex_unlock(&lock);
+  for (int t = 0; t < nworkers; t++) {
+    pthread_join(workers[t], NULL);
+  }
+  free(workers);
+  workers = NULL;
+  nworkers = 0;
+  quit = 0;
+}
+
+/// Set the number of threads used by ParallelFor (including the caller).
+int ParallelSetThreads(int n) { ///
+  stopWorkers();
+  if (n <= 1) {
+    return 1;
+  }
+  workers = (pthread_t*)malloc((size_t)(n - 1) * sizeof(pthread_t));
+  if (workers == NULL) {
+    return 1;
+  }
+  while (nworkers < n - 1 &&
+         pthread_create(&workers[nworkers], NULL, workerMain, NULL) == 0) {
+    nworkers++;
+  }
+  return nworkers + 1;
+}
+
+/// Get the number of threads used by ParallelFor.
+int ParallelThreads(void) { ///
+  return nworkers + 1;
+}
+
+/// Call fn(arg, i) for i = 0, 1, ..., n-1, using the thread pool.
+void ParallelFor(int n, void (*fn)(void* arg, int i), void* arg) { ///
+  // Run serially if there is nothing to share, or the pool is taken.
+  if (n <= 1 || nworkers == 0 || inJob || pthread_mutex_trylock(&busy) != 0) {
+    for (int i = 0; i < n; i++) {
+      fn(arg, i);
+    }
+    return;
+  }
+
+  pthread_mutex_lock(&lock);
+  jobFn = fn;
+  jobArg = arg;
+  jobN = n;
+  jobNext = 0;
+  jobFinished = 0;
+  jobId++;
+  pthread_cond_broadcast(&wake);
+  work();
+  while (jobFinished < jobN) {
+    pthread_cond_wait(&done, &lock);
+  }
+  pthread_mutex_unlock(&lock);
+
+  pthread_mutex_unlock(&busy);
+}
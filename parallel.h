@@ -0,0 +1,36 @@
+/// A minimal thread pool for data-parallel loops.
+///
+/// Use as follows:
+///
+/// ParallelSetThreads(8);  // once, to start the worker threads
+/// ...
+/// ParallelFor(n, fn, arg);  // calls fn(arg, i) for every i in [0, n)
+///
+/// The calls fn(arg, i) may run concurrently, in any order, on the worker
+/// threads and on the calling thread.  ParallelFor returns when all of them
+/// have finished.  So, to get deterministic results, each call should only
+/// write to data that no other call reads or writes (a band of rows of an
+/// image, for instance).
+///
+/// ParallelFor may be called from several threads, or from inside fn:
+/// if the pool is already busy, the loop simply runs serially in the
+/// calling thread.
+
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+/// Set the number of threads used by ParallelFor (including the caller).
+/// n <= 1 makes ParallelFor run serially.
+/// Must not be called while a ParallelFor is running.
+/// Returns the number of threads actually available (which may be less
+/// than n, if the system cannot create more threads).
+int ParallelSetThreads(int n) ;
+
+/// Get the number of threads used by ParallelFor.
+int ParallelThreads(void) ;
+
+/// Call fn(arg, i) for i = 0, 1, ..., n-1, using the thread pool.
+/// Returns after all calls have finished.
+void ParallelFor(int n, void (*fn)(void* arg, int i), void* arg) ;
+
+#endif